@@ -0,0 +1,46 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ */
+
+#include <stdlib.h>
+
+#include "clock.h"
+#include "generator.h"
+
+/** Get wall clock minus CLOCK_MONOTONIC [us]
+ * Reads the wall clock between two reads of the monotonic one and takes the midpoint. */
+static int64_t _mgt_offset(void)
+{
+	struct timespec m1, m2;
+	struct timeval wall;
+	int64_t mono;
+
+	clock_gettime(CLOCK_MONOTONIC, &m1);
+	gettimeofday(&wall, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &m2);
+
+	mono  = ((int64_t) m1.tv_sec + m2.tv_sec) * 500000;
+	mono += ((int64_t) m1.tv_nsec + m2.tv_nsec) / 2000;
+
+	return (int64_t) wall.tv_sec * 1000000 + wall.tv_usec - mono;
+}
+
+void mgt_init(struct mg *mg)
+{
+	mg->mono_offset = _mgt_offset();
+	mg->wall_offset = 0;
+}
+
+void mgt_update(struct mg *mg)
+{
+	int64_t offset;
+
+	offset = _mgt_offset() - mg->mono_offset;
+
+	if (llabs(offset - mg->wall_offset) > 1000)
+		dbg(1, "wall clock moved by %lld us relative to generator time\n",
+			(long long) (offset - mg->wall_offset));
+
+	mg->wall_offset = offset;
+}
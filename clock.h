@@ -0,0 +1,61 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ */
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <time.h>
+#include "generator.h"
+
+/*
+ * Generator time is CLOCK_MONOTONIC shifted to match the wall clock at mgt_init(), so it can be
+ * compared with mg->origin, but is not stepped by NTP. Use it for all scheduling and interval
+ * math; convert to wall clock only where time leaves the node (frame headers, kernel timestamps).
+ */
+
+/** Map generator time onto CLOCK_MONOTONIC
+ * @note call once, after mgc_sync() */
+void mgt_init(struct mg *mg);
+
+/** Refresh the offset between generator time and wall clock, used by mgt_to_wall() */
+void mgt_update(struct mg *mg);
+
+/** Get generator time [us] */
+static inline uint64_t mgt_now(struct mg *mg)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + mg->mono_offset;
+}
+
+/** Version of mgt_now() returning struct timeval */
+static inline void mgt_now_tv(struct mg *mg, struct timeval *tv)
+{
+	uint64_t us = mgt_now(mg);
+
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
+/** Convert generator time to wall clock time, as of last mgt_update() */
+static inline void mgt_to_wall(struct mg *mg, const struct timeval *tv, struct timeval *wall)
+{
+	int64_t us = (int64_t) tv->tv_sec * 1000000 + tv->tv_usec + mg->wall_offset;
+
+	wall->tv_sec  = us / 1000000;
+	wall->tv_usec = us % 1000000;
+}
+
+/** Convert wall clock time, eg. a kernel timestamp, to generator time */
+static inline void mgt_from_wall(struct mg *mg, const struct timeval *wall, struct timeval *tv)
+{
+	int64_t us = (int64_t) wall->tv_sec * 1000000 + wall->tv_usec - mg->wall_offset;
+
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
+#endif
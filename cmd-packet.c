@@ -7,6 +7,7 @@
 #include "interface.h"
 #include "generator.h"
 #include "schedule.h"
+#include "replay.h"
 
 int cmd_packet_init(struct line *line, const char *text)
 {
@@ -31,6 +32,10 @@ int cmd_packet_init(struct line *line, const char *text)
 	cp->num   = mgp_int(mgp_prepare_int(pl, "rep", 1));
 	cp->T     = mgp_prepare_int(pl, "T", 1000);
 	cp->burst = mgp_prepare_int(pl, "burst", 1);
+	cp->next  = (uint64_t) line->tv.tv_sec * 1000000 + line->tv.tv_usec;
+
+	if (!cp->len->isfunc)
+		line->size_max = mgp_int(cp->len);
 
 	return 0;
 }
@@ -39,14 +44,13 @@ void cmd_packet_timeout(int fd, short evtype, void *arg)
 {
 	struct line *line = arg;
 	struct cmd_packet *cp = line->prv;
-	uint32_t i, len, burst;
+	uint32_t len, burst;
 
 	burst = mgp_int(cp->burst);
 	len = mgp_int(cp->len);
 
 	/* send ASAP */
-	for (i = 0; i < burst; i++)
-		mgi_sendto(0, line, NULL, 0, len);
+	mgi_sendto_burst(0, line, NULL, 0, len, burst);
 
 	/* reschedule? */
 	if (cp->num-- > 1)
@@ -55,6 +59,31 @@ void cmd_packet_timeout(int fd, short evtype, void *arg)
 		line->mg->running--;
 }
 
+bool cmd_packet_expand(struct line *line, uint64_t until)
+{
+	struct cmd_packet *cp = line->prv;
+	uint32_t len, burst;
+	bool more;
+
+	/* same as cmd_packet_timeout(), ahead of time */
+	while (cp->next < until) {
+		burst = mgp_int(cp->burst);
+		len = mgp_int(cp->len);
+
+		if (cp->num-- > 1) {
+			more = mge_push(line, cp->next, len, burst, false);
+			cp->next += (uint32_t) (mgp_int(cp->T) * 1000);
+			if (!more)
+				break;
+		} else {
+			mge_push(line, cp->next, len, burst, true);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 void cmd_packet_packet(struct sniff_pkt *pkt)
 {
 	struct cmd_packet *cp = pkt->line->prv;
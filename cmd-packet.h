@@ -14,6 +14,7 @@ struct cmd_packet {
 	int num;                     /**< number of repetitions left */
 	struct mgp_arg *T;           /**< time interval between repetitions [ms] */
 	struct mgp_arg *burst;       /**< number of frames to send in one repetition */
+	uint64_t next;               /**< time of next repetition for replay [us since origin] */
 
 	uint32_t last_ctr;    /**< last ctr value */
 };
@@ -24,6 +25,9 @@ int cmd_packet_init(struct line *line, const char *text);
 /** Handle outgoing packet */
 void cmd_packet_timeout(int fd, short evtype, void *arg);
 
+/** Expand outgoing packets into the replay timeline */
+bool cmd_packet_expand(struct line *line, uint64_t until);
+
 /** Handle incoming packet */
 void cmd_packet_packet(struct sniff_pkt *pkt);
 
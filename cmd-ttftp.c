@@ -33,6 +33,9 @@ int cmd_ttftp_init(struct line *line, const char *text)
 	cp->rate  = mgp_prepare_int(pl, "rate", 1);
 	cp->MB    = mgp_prepare_int(pl, "MB", 1);
 
+	if (!cp->size->isfunc)
+		line->size_max = MAX(mgp_int(cp->size), TTFTP_ACK_SIZE);
+
 	return 0;
 }
 
@@ -40,7 +43,7 @@ void cmd_ttftp_timeout(int fd, short evtype, void *arg)
 {
 	struct line *line = arg;
 	struct cmd_ttftp *cp = line->prv;
-	int todo, i;
+	int todo;
 
 	if (!cp->req_handling) {
 		cp->req_handling = true;
@@ -61,8 +64,7 @@ void cmd_ttftp_timeout(int fd, short evtype, void *arg)
 		todo = cp->req_burst;
 	}
 
-	for (i = 0; i < todo; i++)
-		mgi_sendto(0, line, NULL, 0, cp->req_size);
+	mgi_sendto_burst(0, line, NULL, 0, cp->req_size, todo);
 
 	if (cp->req_left) {
 		cp->req_left -= todo;
@@ -62,5 +62,5 @@ void mgd_dump(struct sniff_pkt *pkt)
 	fwrite(&pp, sizeof pp, 1, fp);
 
 	/* write packet */
-	fwrite(&pkt->pkt, inclen, 1, fp);
+	fwrite(pkt->pkt, inclen, 1, fp);
 }
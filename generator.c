@@ -14,8 +14,10 @@
 #include "cmd-packet.h"
 #include "schedule.h"
 #include "sync.h"
+#include "clock.h"
 #include "stats.h"
 #include "parser.h"
+#include "replay.h"
 
 /** Reverse bits (http://graphics.stanford.edu/~seander/bithacks.html#BitReverseTable) */
 const uint8_t REVERSE[256] =
@@ -67,6 +69,12 @@ static void apply_defaults(struct mg *mg)
 	mg->options.stats_root = DEFAULT_STATS_ROOT;
 	mg->options.sync       = DEFAULT_SYNC_PERIOD;
 	mg->options.svc_ifname = DEFAULT_SVC_IFNAME;
+	mg->options.seq_window = DEFAULT_SEQ_WINDOW;
+	mg->options.scheduler  = DEFAULT_SCHEDULER;
+	mg->options.cpu        = -1;
+	mg->options.txcpu      = -1;
+	mg->options.rxfanout   = DEFAULT_RX_FANOUT;
+	mg->options.late_threshold = DEFAULT_LATE_THRESHOLD;
 }
 
 /** Parses arguments and loads modules
@@ -178,6 +186,52 @@ static int parse_config_ut(struct mg *mg, ut *cfg)
 			mg->options.dumpb = ut_bool(subcfg);
 		} else if (streq(key, "svc-ifname")) {
 			mg->options.svc_ifname = ut_char(subcfg);
+		} else if (streq(key, "tx-ring")) {
+			mg->options.txring = ut_int(subcfg);
+		} else if (streq(key, "rx-ring")) {
+			mg->options.rxring = ut_int(subcfg);
+		} else if (streq(key, "rx-batch")) {
+			mg->options.rxbatch = ut_int(subcfg);
+		} else if (streq(key, "filter")) {
+			mg->options.filter = ut_bool(subcfg);
+		} else if (streq(key, "filter-sample")) {
+			mg->options.filter_sample = ut_int(subcfg);
+		} else if (streq(key, "seq-window")) {
+			mg->options.seq_window = ut_int(subcfg);
+		} else if (streq(key, "hw-timestamps")) {
+			mg->options.hwts = ut_bool(subcfg);
+		} else if (streq(key, "tx-timestamps")) {
+			mg->options.txts = ut_bool(subcfg);
+		} else if (streq(key, "txtime")) {
+			mg->options.txtime = ut_int(subcfg);
+		} else if (streq(key, "scheduler")) {
+			mg->options.scheduler = ut_char(subcfg);
+			if (!streq(mg->options.scheduler, "libevent") && !streq(mg->options.scheduler, "wheel")) {
+				dbg(0, "invalid scheduler: %s\n", mg->options.scheduler);
+				return 1;
+			}
+		} else if (streq(key, "precision")) {
+			mg->options.precision = ut_int(subcfg);
+		} else if (streq(key, "cpu")) {
+			mg->options.cpu = ut_int(subcfg);
+		} else if (streq(key, "late-threshold")) {
+			mg->options.late_threshold = ut_int(subcfg);
+		} else if (streq(key, "replay")) {
+			mg->options.replay = ut_bool(subcfg);
+		} else if (streq(key, "tx-threads")) {
+			mg->options.txthreads = ut_bool(subcfg);
+		} else if (streq(key, "tx-cpu")) {
+			mg->options.txcpu = ut_int(subcfg);
+		} else if (streq(key, "stats-log")) {
+			mg->options.statslog = ut_bool(subcfg);
+		} else if (streq(key, "rx-threads")) {
+			mg->options.rxthreads = ut_int(subcfg);
+		} else if (streq(key, "rx-fanout")) {
+			mg->options.rxfanout = ut_char(subcfg);
+			if (!streq(mg->options.rxfanout, "hash") && !streq(mg->options.rxfanout, "cpu")) {
+				dbg(0, "invalid rx-fanout: %s\n", mg->options.rxfanout);
+				return 1;
+			}
 		} else {
 			dbg(0, "unrecognized configuration file option: %s\n", key);
 			return 1;
@@ -277,6 +331,7 @@ static bool find_line_cmd(struct line *line)
 		int (*fun_init)(struct line *, const char *);
 		void (*fun_timeout)(int, short, void *);
 		void (*fun_packet)(struct sniff_pkt *);
+		bool (*fun_expand)(struct line *, uint64_t);
 	} ptr2func;
 
 	if (!me)
@@ -309,6 +364,11 @@ static bool find_line_cmd(struct line *line)
 	else
 		line->cmd_packet = ptr2func.fun_packet;
 
+	/* replay timeline expansion (optional) */
+	snprintf(buf, sizeof buf, "cmd_%s_expand", line->cmd);
+	ptr2func.ptr = dlsym(me, buf);
+	line->cmd_expand = ptr2func.fun_expand;
+
 	return true;
 }
 
@@ -403,11 +463,21 @@ static int parse_traffic(struct mg *mg)
 
 		/* initialize scheduler of outgoing frames */
 		mgs_setup(&line->schedule, mg, line->cmd_timeout, line);
+		line->schedule.stats = line->stats;
 
 		/* call command initializer */
 		rc = line->cmd_init(line, rest);
 		if (rc != 0)
 			return rc;
+
+		/* prepare frame template */
+		mgi_line_init(line);
+
+		/* prepare stats of links we will receive on: the line itself, or replies to our line */
+		if (line->dstid == mg->options.myid)
+			mgi_linkstats_add(line->interface, line->srcid, line->dstid);
+		else if (line->my)
+			mgi_linkstats_add(line->interface, line->dstid, line->srcid);
 	}
 
 	fclose(fp);
@@ -425,9 +495,16 @@ static void heartbeat(int fd, short evtype, void *arg)
 		mg->mmtmp = mmatic_create();
 	}
 
+	/* follow wall clock adjustments */
+	mgt_update(mg);
+	mgi_phc_update(mg);
+
+	/* account frames missing at the end of lines */
+	mgi_seq_expire(mg);
+
 	/* if no line generator is running and there was no packet to us in last 60 seconds - exit */
 	if (mg->running == 0) {
-		gettimeofday(&now, NULL);
+		mgt_now_tv(mg, &now);
 		timersub(&now, &mg->last, &diff);
 
 		if (diff.tv_sec >= 60) {
@@ -474,7 +551,8 @@ static void handle_packet(struct sniff_pkt *pkt)
 	return;
 }
 
-/** Aggregate stats from all lines */
+/** Aggregate stats from all lines
+ * Lines of this node are left for _stats_line(), which is registered later and zeroes them. */
 static bool _stats_aggregate_lines(struct mg *mg, stats *stats, void *arg)
 {
 	int i;
@@ -483,12 +561,24 @@ static bool _stats_aggregate_lines(struct mg *mg, stats *stats, void *arg)
 		if (!mg->lines[i])
 			continue;
 
-		stats_aggregate(stats, mg->lines[i]->stats);
+		if (mg->lines[i]->my)
+			stats_merge(stats, mg->lines[i]->stats);
+		else
+			stats_aggregate(stats, mg->lines[i]->stats);
 	}
 
 	return true;
 }
 
+/** Stats of single line */
+static bool _stats_line(struct mg *mg, stats *stats, void *arg)
+{
+	struct line *line = arg;
+
+	stats_aggregate(stats, line->stats);
+	return true;
+}
+
 /** Global stats */
 static bool _stats_global(struct mg *mg, stats *stats, void *arg)
 {
@@ -499,6 +589,9 @@ static bool _stats_global(struct mg *mg, stats *stats, void *arg)
 /** Initialize global stats stuff */
 static void _stats_init(struct mg *mg)
 {
+	char filename[32];
+	int i;
+
 	mg->stats = stats_create(mg->mm);
 
 	/* iitis-generator internal stats */
@@ -507,6 +600,15 @@ static void _stats_init(struct mg *mg)
 		NULL, "internal-stats.txt",
 		"scheduler_evt",
 		"scheduler_lag",
+		"scheduler_error_p50",
+		"scheduler_error_p99",
+		"scheduler_error_max",
+		"scheduler_late_p50",
+		"scheduler_late_p99",
+		"scheduler_late_max",
+		"scheduler_debt",
+		"stats_flush_max",
+		"stats_overrun",
 		NULL);
 
 	/* global stats of line generators */
@@ -516,12 +618,50 @@ static void _stats_init(struct mg *mg)
 		"snt_ok",
 		"snt_time",
 		"snt_err",
+		"snt_time_p50",
+		"snt_time_p99",
+		"snt_time_max",
+		"snt_sched_p50",
+		"snt_sched_p99",
+		"snt_qdelay_p50",
+		"snt_qdelay_p99",
+		"snt_qdelay_max",
 		"rcv_ok",
 		"rcv_ok_bytes",
 		"rcv_dup",
 		"rcv_dup_bytes",
 		"rcv_lost",
+		"rcv_reorder",
+		"rcv_late",
+		"rcv_delay_avg",
+		"rcv_delay_p50",
+		"rcv_delay_p99",
+		"rcv_delay_max",
+		"rcv_delay_neg",
 		NULL);
+
+	/* stats of each line generator; must come after linestats.txt, see _stats_aggregate_lines() */
+	for (i = 1; i < TRAFFIC_LINE_MAX; i++) {
+		if (!(mg->lines[i] && mg->lines[i]->my))
+			continue;
+
+		snprintf(filename, sizeof filename, "line-%d.txt", i);
+		mgstats_writer_add(mg,
+			_stats_line, mg->lines[i],
+			"lines", filename,
+			"snt_ok",
+			"snt_err",
+			"snt_time_p50",
+			"snt_time_p99",
+			"snt_time_max",
+			"scheduler_evt",
+			"scheduler_lag",
+			"scheduler_late_p50",
+			"scheduler_late_p99",
+			"scheduler_late_max",
+			"scheduler_debt",
+			NULL);
+	}
 }
 
 int main(int argc, char *argv[])
@@ -584,6 +724,16 @@ int main(int argc, char *argv[])
 	/* synchronize time reference point on all nodes */
 	mgc_sync(mg);
 
+	/* from now on, measure time on the monotonic clock */
+	mgt_init(mg);
+
+	/* start TX worker threads, before mgs_init() pins this thread */
+	mgi_start(mg);
+
+	/* setup scheduler */
+	if (mgs_init(mg))
+		return 2;
+
 	/* schedule stats writing */
 	mgstats_start(mg);
 
@@ -600,12 +750,16 @@ int main(int argc, char *argv[])
 			continue;
 
 		/* this will schedule first execution */
-		mgs_sleep(mg->lines[i], NULL);
+		if (!(mg->options.replay && mge_add(mg, mg->lines[i])))
+			mgs_sleep(mg->lines[i], NULL);
 		mg->running++;
 	}
 
+	/* replay lines with deterministic timing from a single timeline */
+	mge_start(mg);
+
 	/* suppose last frame was received now */
-	gettimeofday(&mg->last, NULL);
+	mgt_now_tv(mg, &mg->last);
 
 	/*
 	 * start!
@@ -620,6 +774,7 @@ int main(int argc, char *argv[])
 	 * cleanup after end of libevent loop
 	 */
 
+	mgstats_stop(mg);
 	event_base_free(mg->evb);
 	mmatic_free(mg->mm);
 	mmatic_free(mg->mmtmp);
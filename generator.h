@@ -6,6 +6,8 @@
 #ifndef _GENERATOR_H_
 #define _GENERATOR_H_
 
+#include <sys/queue.h>
+#include <pthread.h>
 #include <libpjf/lib.h>
 #include <event.h>
 
@@ -26,6 +28,54 @@
 /** size of a buffer for frames */
 #define PKT_BUFSIZE 1600
 
+/** max number of frames handed to the kernel in one sendmmsg() call */
+#define PKT_BURST_MAX 32
+
+/** number of radiotap layouts cached per interface */
+#define RADIO_CACHE_SIZE 4
+
+/** max length of in-kernel BPF frame filter */
+#define MGI_FILTER_MAX 64
+
+/** RX ring block size */
+#define RXRING_BLOCK_SIZE (1 << 16)
+
+/** RX ring frame size hint (TPACKET_V3 uses variable frame sizes) */
+#define RXRING_FRAME_SIZE 2048
+
+/** RX ring block retire timeout [ms] */
+#define RXRING_BLOCK_TIMEOUT 10
+
+/** Size of control message buffer for receive timestamps */
+#define PKT_CMSG_SIZE 128
+
+/** Number of card clock readings to pick from when converting hardware timestamps */
+#define PHC_SAMPLES 5
+
+/** Number of sent frames waiting for TX timestamps, power of 2 */
+#define TXTS_RING_SIZE 1024
+
+/** Number of frame bursts queued to TX worker thread, power of 2 */
+#define TXW_RING_SIZE 256
+
+/** Space in TX worker queue entry for frame data that needs to be copied */
+#define TXW_DATA_SIZE 4096
+
+/** Space in TX worker queue entry for control messages */
+#define TXW_CTRL_SIZE 32
+
+/** stdio buffer of binary stats log, see options.statslog */
+#define STATSLOG_BUFSIZE 65536
+
+/** Number of stats rows of each writer that may wait for the stats writer thread */
+#define STATS_RING 8
+
+/** Number of classified frames queued by RX thread to the main thread, power of 2 */
+#define RXW_RING_SIZE 512
+
+/** Max frames per recvmmsg() call of RX thread */
+#define RXW_BATCH 32
+
 /** EtherType for generated packets */
 #define PKT_ETHERTYPE 0x0111
 
@@ -65,6 +115,37 @@
 /** Heartbeat period */
 #define HEARTBEAT_PERIOD 1000000
 
+/** Timer implementation by default, see options.scheduler */
+#define DEFAULT_SCHEDULER "libevent"
+
+/** Final part of precision wait which is spun instead of slept [us], see options.precision */
+#define SCHED_SPIN 20
+
+/** Line callback lateness above which it is added to scheduler_debt by default [us] */
+#define DEFAULT_LATE_THRESHOLD 1000
+
+/** PACKET_FANOUT mode of RX threads by default, see options.rxfanout */
+#define DEFAULT_RX_FANOUT "hash"
+
+/** Length of replay timeline chunk expanded at once [us], see replay.c */
+#define MGE_CHUNK 1000000
+
+/** Max number of replay events dispatched in one timer run */
+#define MGE_BATCH_MAX 256
+
+/** Max number of replay events of one line in a chunk; denser lines fall behind */
+#define MGE_LINE_MAX 65536
+
+/** Receive sequence window size [frames] by default, see struct mgi_seqwin */
+#define DEFAULT_SEQ_WINDOW 256
+
+/** Limits of receive sequence window size [frames] */
+#define SEQ_WINDOW_MIN 64
+#define SEQ_WINDOW_MAX 1024
+
+/** Time without frames after which counters still missing from a receive window are lost [s] */
+#define SEQ_IDLE 5
+
 /** Number of samples in link stats averages */
 #define LINK_AVG_LEN 10
 
@@ -74,36 +155,160 @@ struct sniff_pkt;
 struct line;
 struct schedule;
 
-/** Statistics */
-typedef struct stats {
-	thash *db;
-	mmatic *mm;
-} stats;
+/** Max number of distinct statistics names */
+#define STATS_MAX 128
+
+/** Statistics known at compile time; names in stats.c, other names get ids from stats_id() */
+enum stats_id {
+	ST_SCHEDULER_EVT = 0,
+	ST_SCHEDULER_LAG,
+	ST_SCHEDULER_ERROR,
+	ST_SCHEDULER_LATE,
+	ST_SCHEDULER_DEBT,
+	ST_STATS_FLUSH,
+	ST_STATS_OVERRUN,
+
+	ST_SNT_OK,
+	ST_SNT_OK_BYTES,
+	ST_SNT_ERR,
+	ST_SNT_TIME,
+	ST_SNT_RING_FULL,
+	ST_SNT_KICK_ERR,
+	ST_SNT_QUEUE_FULL,
+	ST_SNT_SCHED,
+	ST_SNT_QDELAY,
+	ST_SNT_TXTIME_LATE,
+	ST_SNT_TXTIME_DROP,
+	ST_SNT_TXTS_MISS,
+
+	ST_RCV_ALL,
+	ST_RCV_ALL_BYTES,
+	ST_RCV_CFP,
+	ST_RCV_SHORTPRE,
+	ST_RCV_FRAG,
+	ST_RCV_BADFCS,
+	ST_RCV_BEACONS,
+	ST_RCV_ACK,
+	ST_RCV_NONDATA,
+	ST_RCV_RETRY,
+	ST_RCV_WRONG_BSSID,
+	ST_RCV_WRONG_CHANNEL,
+	ST_RCV_WRONG_DST,
+	ST_RCV_ALIENS,
+	ST_RCV_OK,
+	ST_RCV_OK_BYTES,
+	ST_RCV_DUP,
+	ST_RCV_DUP_BYTES,
+	ST_RCV_LOST,
+	ST_RCV_DELAY,
+	ST_RCV_DELAY_NEG,
+	ST_RCV_REORDER,
+	ST_RCV_LATE,
+	ST_RCV_QUEUE_FULL,
+
+	ST_RCV_BATCH_1,            /**< first of log2 batch size buckets, see _mgi_sniff_batch() */
+	ST_RCV_BATCH_LAST = ST_RCV_BATCH_1 + 7,
+
+	ST_RSSI,
+	ST_RATE,
+	ST_ANTNUM,
+
+	ST_STATIC                  /**< number of ids above */
+};
+
+/** Histogram buckets per power of 2, as log2; bounds relative error of percentiles to 1/16 */
+#define STATS_HIST_SUB_BITS 4
+
+/** Number of histogram buckets covering whole uint32_t range */
+#define STATS_HIST_BUCKETS ((32 - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS)
+
+/** Log-linear histogram of values, see stats_ihist() */
+struct stats_hist {
+	uint32_t count;                  /**< number of values */
+	uint32_t min;                    /**< smallest value */
+	uint32_t max;                    /**< largest value */
+	uint64_t sum;                    /**< sum of values */
+	uint32_t bucket[STATS_HIST_BUCKETS];
+};
 
 /** Statistics node */
 struct stats_node {
 	/** node type */
 	enum {
-		STATS_COUNTER = 1,
-		STATS_GAUGE
+		STATS_NONE = 0,              /**< not touched yet */
+		STATS_COUNTER,
+		STATS_GAUGE,
+		STATS_HISTOGRAM
 	} type;
 
 	/** current value */
 	union {
-		uint32_t counter;
+		uint32_t counter;            /**< word size, see stats_icountN() */
 		int gauge;                   /**< real value x 100 */
+		struct stats_hist *hist;     /**< allocated on first value */
 	} as;
 };
 
+/** Statistics */
+typedef struct stats {
+	/** nodes indexed by stats id; cache line aligned, so that shards of threads do not share lines */
+	struct stats_node node[STATS_MAX] __attribute__((aligned(64)));
+	uint32_t seq;                       /**< odd while owner thread updates node, see stats_write_begin() */
+	mmatic *mm;
+	struct stats_shard *shards;         /**< counters updated by other threads, see stats_shard_add() */
+} stats;
+
+/** Counters of stats db owned by another thread
+ * The owner only ever increases counters of live; readers take consistent snapshots under
+ * live->seq and aggregate differences against the previous snapshot. */
+struct stats_shard {
+	struct stats_shard *next;
+	struct stats *live;                 /**< stats db of the owner thread */
+	uint32_t seen[STATS_MAX];           /**< counter values at previous snapshot */
+};
+
+/** Timer wheel: number of slots per level, as log2 */
+#define MGS_WHEEL_BITS 6
+
+/** Timer wheel: number of slots per level */
+#define MGS_WHEEL_LEN (1 << MGS_WHEEL_BITS)
+
+/** Timer wheel: number of levels; covers 2^36 us (19 hours), longer timers get re-inserted */
+#define MGS_WHEEL_NUM 6
+
+/** Timer wheel: max time ahead handled directly [us] */
+#define MGS_WHEEL_MAX ((UINT64_C(1) << (MGS_WHEEL_BITS * MGS_WHEEL_NUM)) - 1)
+
+/** List of schedules in a timer wheel slot */
+TAILQ_HEAD(mgs_list, schedule);
+
+/** Hierarchical timer wheel driving all schedules with a single libevent timer, see schedule.c */
+struct mgs_wheel {
+	struct mg *mg;                                     /**< root */
+	uint64_t now;                                      /**< wheel time [us] */
+	uint64_t armed;                                    /**< time ev is set to [us], 0 = not set */
+	bool running;                                      /**< running expired callbacks */
+	uint64_t pending[MGS_WHEEL_NUM];                   /**< bitmaps of non-empty slots */
+	struct mgs_list slot[MGS_WHEEL_NUM][MGS_WHEEL_LEN];/**< timers by level and slot */
+	struct mgs_list expired;                           /**< timers due */
+	struct event ev;                                   /**< libevent timer */
+};
+
 /** Scheduler info */
 struct schedule {
 	struct mg *mg;                   /**< root */
 
 	struct event ev;                 /**< libevent handle */
 	struct timeval last;             /**< absolute time of last run */
+	struct timeval launch;           /**< target time of running callback, if options.txtime */
 
 	void (*cb)(int, short, void *);  /**< timer callback */
 	void *arg;                       /**< timer callback argument */
+	stats *stats;                    /**< if not NULL, where to count callback lateness */
+
+	uint64_t expire;                 /**< timer wheel: expiry time [us] */
+	struct mgs_list *wlist;          /**< timer wheel: list we are on, or NULL */
+	TAILQ_ENTRY(schedule) wentry;    /**< timer wheel: list entry */
 };
 
 /** Traffic file line */
@@ -114,9 +319,11 @@ struct line {
 
 	uint32_t line_num;               /**< line number in traffic file */
 	uint32_t line_ctr;               /**< line counter for sending */
-	uint32_t line_ctr_rcv;           /**< line counter for receiving */
+	struct mgi_seqwin *seqwin;       /**< receive sequence windows, one per (srcid, interface) */
 
 	const char *contents;            /**< line contents */
+	struct line_tpl *tpl;            /**< cached frame template */
+	int size_max;                    /**< max frame size, set by cmd_init(); 0 = unknown */
 	struct timeval tv;               /**< time of first packet (time anchor) */
 	struct interface *interface;     /**< interface number */
 	uint8_t srcid;                   /**< src id (keep in sync with NODE_MAX) */
@@ -141,25 +348,125 @@ struct line {
 	 * @param pkt    the captured packet */
 	void (*cmd_packet)(struct sniff_pkt *pkt);
 
+	/** Expand outgoing frames into the replay timeline using mge_push(); optional
+	 * @param line   pointer to this struct line
+	 * @param until  expand frames due before this time [us since origin]
+	 * @retval true  line has more frames after until, or stopped early as told by mge_push() */
+	bool (*cmd_expand)(struct line *line, uint64_t until);
+
 	void *prv;                       /**< command private data */
 
 	stats *stats;                    /**< line statistics */
 };
 
+/** Memory-mapped TX ring (PACKET_TX_RING, TPACKET_V2) */
+struct mgi_txring {
+	uint8_t *map;              /**< mmap()ed ring memory, NULL if not used */
+	size_t size;               /**< size of map */
+	uint32_t frame_size;       /**< size of single frame slot */
+	uint32_t frame_nr;         /**< number of frame slots */
+	uint32_t head;             /**< next slot to fill */
+};
+
+/** Memory-mapped RX ring (PACKET_RX_RING, TPACKET_V3) */
+struct mgi_rxring {
+	int fd;                    /**< dedicated RX socket */
+	uint8_t *map;              /**< mmap()ed ring memory, NULL if not used */
+	size_t size;               /**< size of map */
+	uint32_t block_size;       /**< size of single block */
+	uint32_t block_nr;         /**< number of blocks */
+	uint32_t block;            /**< next block to read */
+};
+
+/** Buffers for batched receive using recvmmsg() */
+struct mgi_rxbatch {
+	int num;                   /**< max number of frames per recvmmsg() call */
+	uint8_t *bufs;             /**< num frame buffers, PKT_BUFSIZE each */
+	struct iovec *iov;         /**< iovecs pointing at bufs */
+	struct mmsghdr *msgs;      /**< recvmmsg() message headers */
+	uint8_t *ctrl;             /**< num control message buffers, PKT_CMSG_SIZE each */
+};
+
+/** Frame sent with TX timestamps enabled */
+struct mgi_txts_slot {
+	uint32_t id;               /**< timestamp key, see SOF_TIMESTAMPING_OPT_ID */
+	struct timeval sent;       /**< generator time of handing frame to the kernel */
+	struct line *line;         /**< line which sent the frame, may be NULL */
+};
+
+/** TX timestamps state of interface */
+struct mgi_txts {
+	bool on;                   /**< TX timestamps enabled */
+	uint32_t next;             /**< timestamp key of next frame */
+	struct mgi_txts_slot *slot;/**< TXTS_RING_SIZE frames, indexed by key */
+};
+
+/** Radio fields decoded from radiotap header, see radio.c */
+enum mgr_field {
+	MGR_TSFT = 0,
+	MGR_FLAGS,
+	MGR_RATE,
+	MGR_CHANNEL,
+	MGR_RSSI,
+	MGR_ANTENNA,
+	MGR_FIELDS
+};
+
+/** Radiotap field offsets compiled for a given radiotap header layout */
+struct mgr_layout {
+	uint32_t present;          /**< first it_present word, CPU-endian */
+	uint16_t len;              /**< it_len */
+	uint16_t words;            /**< number of it_present words, 0 = unused slot */
+	int16_t off[MGR_FIELDS];   /**< offsets of fields from frame start, -1 = not present */
+};
+
+/** Cache of radiotap layouts seen on an interface */
+struct mgr_cache {
+	struct mgr_layout layout[RADIO_CACHE_SIZE];
+	int next;                  /**< slot to replace on next miss */
+};
+
 /** Represents network interface */
 struct interface {
 	struct mg *mg;             /**< root */
 	const char *name;          /**< interface name */
 	int num;                   /**< interface number */
-	int fd;                    /**< raw interface socket */
+	int fd;                    /**< raw interface socket (TX, and RX unless rxring is used) */
 	struct event evread;       /**< read event */
+	struct mgi_txring txring;  /**< optional TX ring */
+	struct mgi_rxring rxring;  /**< optional RX ring */
+	struct mgi_rxbatch rxbatch;/**< optional recvmmsg() buffers */
+	struct mgi_txts txts;      /**< optional TX timestamps */
+	struct mgi_txw *txw;       /**< optional TX worker thread */
+	struct mgi_rxw **rxw;      /**< optional RX threads, rxw_num of them */
+	int rxw_num;               /**< number of RX threads */
+	bool txtime;               /**< frames carry launch time, see options.txtime */
+	bool errqueue;             /**< socket error queue is read: TX timestamps or launch time errors */
+	struct event everr;        /**< error queue read event, if fd is not read otherwise */
+	int64_t tai_offset;        /**< CLOCK_TAI minus CLOCK_REALTIME [ns], see mgt_to_wall() */
+	int phc_fd;                /**< clock of network card making hardware timestamps, see mgi_phc_update() */
+	int64_t phc_offset[2];     /**< CLOCK_REALTIME minus card clock [ns]; phc_offset[phc_cur] is in use */
+	uint32_t phc_cur;          /**< flipped once the other phc_offset is updated, as RX threads read it */
+	struct mgr_cache radio;    /**< radiotap layout cache */
+	int sample_fd;             /**< socket sampling frames rejected by in-kernel filter */
+	struct event evsample;     /**< sample_fd read event */
 
 	stats *stats;              /**< statistics */
-	thash *linkstats;          /**< link statistics: "srcid-dstid" -> thash *linkstats */
+	stats **linkstats[NODE_MAX+1]; /**< link statistics: [dstid][srcid], row of this node preallocated */
+	uint8_t linkw[NODE_MAX+1]; /**< writer state of link from srcid to this node, enum mgi_linkw */
+	bool linkw_pending;        /**< evlinkw is armed */
+	struct event evlinkw;      /**< registers writers of links first seen in mgi_linkstats_get() */
 
 	FILE *dumpfile;            /**< packet dump file */
 };
 
+/** Writer state of link to this node */
+enum mgi_linkw {
+	MGI_LINKW_NONE = 0,        /**< no stats file writer yet */
+	MGI_LINKW_PENDING,         /**< waiting for evlinkw */
+	MGI_LINKW_DONE             /**< writer registered */
+};
+
 /** A function which does statistics aggregation
  * @param stats  write final stats here
  * @param arg    argument passed during mgstats_writer_add()
@@ -168,15 +475,88 @@ struct interface {
  */
 typedef bool (*stats_writer_handler_t)(struct mg *mg, stats *stats, void *arg);
 
+/** Column of statistics file */
+struct stats_column {
+	int id;                              /**< stats id */
+
+	/** what to write for histograms; other stats always write their value */
+	enum {
+		STATS_COL_VALUE = 0,             /**< sum of values */
+		STATS_COL_PCT,                   /**< percentile, column name suffix "_pNN" */
+		STATS_COL_MIN,                   /**< "_min" */
+		STATS_COL_MAX,                   /**< "_max" */
+		STATS_COL_AVG,                   /**< "_avg" */
+		STATS_COL_COUNT                  /**< "_count" */
+	} what;
+
+	int pct;                             /**< percentile x 100 for STATS_COL_PCT */
+};
+
 /** Represents process of aggregation of statistics from many single sources and writing them to a
  * statistics file */
 struct stats_writer {
 	stats_writer_handler_t handler;      /**< callback handler */
 	void *arg;                           /**< argument to pass to handler */
 	tlist *columns;                      /**< column names to export */
+	struct stats_column *cols;           /**< resolved columns, in the same order */
 	const char *dirname;                 /**< optional directory under main stats dir */
 	const char *filename;                /**< stats file name */
 	FILE *fh;                            /**< open file handle */
+
+	struct stats_writer *next;           /**< next writer, see mg->stats_writers */
+	stats *buf[STATS_RING];              /**< queued results of handler, see mgstats_async */
+	bool ok[STATS_RING];                 /**< handler asked to write buf */
+
+	bool logged;                         /**< schema written to binary log, see options.statslog */
+	uint32_t logid;                      /**< writer number in binary log */
+};
+
+/** Stats writer thread, which formats and writes results of handlers to files
+ * The event loop fills buffers number head % STATS_RING of each writer, then hands them over by
+ * advancing head, while the thread writes buffers from tail up to head, one row each. */
+struct mgstats_async {
+	pthread_t thread;                    /**< writer thread */
+	pthread_mutex_t lock;                /**< protects fields below */
+	pthread_cond_t cond;                 /**< signals change of head, tail or stop */
+
+	uint32_t head;                       /**< next buffers to fill by the event loop */
+	uint32_t tail;                       /**< next buffers to write by the thread */
+	bool stop;                           /**< exit after writing pending buffers */
+	struct timeval time[STATS_RING];     /**< generator time of buffers */
+	struct stats_writer *last[STATS_RING]; /**< last writer with buffers */
+
+	bool flushed;                        /**< flush_time not accounted yet */
+	uint32_t flush_time;                 /**< time of last write of all buffers [us] */
+
+	/** used by the thread only */
+	FILE *log;                           /**< binary log, see options.statslog */
+	uint32_t log_writers;                /**< number of writers in log */
+};
+
+/** Frame burst on replay timeline */
+struct mge_event {
+	uint64_t time;             /**< send time [us since origin] */
+	struct line *line;         /**< line to send */
+	uint32_t len;              /**< frame size */
+	uint32_t burst;            /**< number of frames */
+	bool last;                 /**< last event of line */
+};
+
+/** Replay engine: traffic file lines expanded into time-sorted send events */
+struct mge {
+	struct mg *mg;                        /**< root */
+	struct schedule sch;                  /**< the only timer */
+
+	struct line *lines[TRAFFIC_LINE_MAX]; /**< lines still being expanded */
+	int lines_num;                        /**< number of lines in lines */
+	uint64_t horizon;                     /**< events due before it are expanded [us since origin] */
+
+	struct mge_event *ev;                 /**< events of current chunk, sorted by time */
+	int num;                              /**< number of events in ev */
+	int size;                             /**< allocated size of ev */
+	int cur;                              /**< next event to dispatch */
+	int line_first;                       /**< first event of line being expanded, see mge_push() */
+	uint64_t at;                          /**< time sch is set to [us since origin] */
 };
 
 /** Incoming frame callback type
@@ -189,6 +569,8 @@ struct mg {
 	mmatic *mmtmp;             /**< mm that can be freed anytime in main() */
 
 	struct event_base *evb;    /**< libevent base */
+	struct mgs_wheel *wheel;   /**< timer wheel, if options.scheduler is "wheel" */
+	struct mge *replay;        /**< replay engine, if options.replay */
 	struct schedule hbs;       /**< heartbeat schedule info */
 	struct schedule syncs;     /**< sync() schedule info */
 
@@ -196,6 +578,9 @@ struct mg {
 
 	bool synced;               /**< true if origin is valid */
 	struct timeval origin;     /**< time origin (same on all nodes) */
+	int64_t clock_offset;      /**< master clock minus local clock [us], see mgc_sync() */
+	int64_t mono_offset;       /**< generator time minus CLOCK_MONOTONIC [us], see clock.h */
+	int64_t wall_offset;       /**< wall clock minus generator time [us], see mgt_update() */
 
 	/** command line options */
 	struct {
@@ -214,6 +599,25 @@ struct mg {
 		bool dumpb;             /**< include beacons in dump files */
 
 		const char *svc_ifname; /**< name of service network interface */
+		int txring;             /**< TX ring size [frames], 0 = use sendmmsg() */
+		int rxring;             /**< RX ring size [kB], 0 = use recvfrom() */
+		int rxbatch;            /**< max frames per recvmmsg() call, 0/1 = use recvfrom() */
+		bool filter;            /**< filter frames in kernel */
+		int filter_sample;      /**< sample 1/filter_sample frames rejected by filter */
+		int seq_window;         /**< receive sequence window size [frames] */
+		bool hwts;              /**< prefer hardware receive timestamps */
+		bool txts;              /**< read TX timestamps of sent frames */
+		int txtime;             /**< if > 0, inject with launch time; timers fire that much earlier [us] */
+		const char *scheduler;  /**< timer implementation: "libevent" or "wheel" */
+		int precision;          /**< if > 0, timers fire that much earlier and sleep/spin the rest [us] */
+		int cpu;                /**< CPU to pin to, -1 = no pinning */
+		int late_threshold;     /**< line callback lateness counted as time debt [us] */
+		bool replay;            /**< send lines supporting it from a precomputed timeline */
+		bool txthreads;         /**< inject frames from per-interface worker threads */
+		int txcpu;              /**< pin TX worker threads to CPUs starting at txcpu, -1 = no pinning */
+		bool statslog;          /**< write all stats to a single binary log, see statslog.h */
+		int rxthreads;          /**< number of PACKET_FANOUT receive threads per interface, 0 = none */
+		const char *rxfanout;   /**< PACKET_FANOUT mode: "hash" or "cpu" */
 	} options;
 
 	/** interfaces - see interface.c */
@@ -225,12 +629,14 @@ struct mg {
 
 	/* hearbeat */
 	int running;               /**< number of still "running" lines */
-	struct timeval last;       /**< time of last frame destined to us */
+	struct timeval last;       /**< generator time of last frame destined to us */
 
 	/* stats */
 	struct event statsev;      /**< stats write event */
 	const char *stats_dir;     /**< final stats dir path */
-	tlist *stats_writers;      /**< tlist of struct stats_writer */
+	struct stats_writer *stats_writers;      /**< list of struct stats_writer */
+	struct stats_writer *stats_writers_last; /**< last element of stats_writers */
+	struct mgstats_async stats_async;        /**< stats writer thread */
 
 	stats *stats;              /**< global iitis-generator statistics */
 };
@@ -240,18 +646,134 @@ struct mg_hdr {
 	uint32_t mg_tag;           /**< mg protocol tag */
 #define MG_TAG_V1 0xFEEEED01
 
-	uint32_t time_s;           /**< local time: seconds */
-	uint32_t time_us;          /**< local time: microseconds */
+	uint32_t time_s;           /**< send time in master timebase: seconds */
+	uint32_t time_us;          /**< send time in master timebase: microseconds */
 	uint32_t line_num;         /**< traffic file line number */
 	uint32_t line_ctr;         /**< counter inside this single line */
 };
 
+/** Sliding window of line counters received from one source on one interface
+ * Counter c maps to bit (c mod size) of the bitmap; the window covers counters (top - size, top].
+ * A counter still missing when the window slides past it is counted as lost; so are all counters
+ * missing when no frame came for SEQ_IDLE seconds, eg. at the end of the line. */
+struct mgi_seqwin {
+	struct mgi_seqwin *next;      /**< next window of the same line */
+	struct interface *interface;  /**< receiving interface */
+	uint8_t srcid;                /**< source node */
+	stats *linkstats;             /**< link stats of last frame */
+	struct timeval last;          /**< time of last frame */
+
+	uint32_t top;                 /**< highest line counter received */
+	uint32_t size;                /**< window size [frames], power of 2 */
+	uint64_t *bits;               /**< bitmap of received counters */
+
+	bool closed;                  /**< counters up to floor already accounted, see mgi_seq_expire() */
+	uint32_t floor;               /**< top when the window was closed */
+};
+
+/** Classification of received frame by its line counter, see _mgi_seq() */
+enum mgi_seq {
+	MGI_SEQ_NEW = 0,              /**< highest counter so far */
+	MGI_SEQ_REORDER,              /**< missing counter from the window, ie. reordered frame */
+	MGI_SEQ_DUP,                  /**< counter already received */
+	MGI_SEQ_LATE                  /**< counter behind the window or closed, already counted as lost */
+};
+
+/** Headers prepended to each injected frame; kept contiguous so they fit in one iovec */
+struct mgi_hdrs {
+	uint8_t rtap[PKT_RADIOTAP_HDRSIZE];         /**< radiotap header */
+	uint8_t ieee80211[PKT_IEEE80211_HDRSIZE];   /**< 802.11 header */
+	uint8_t llc[PKT_LLC_HDRSIZE];               /**< LLC header */
+};
+
+/** Cached frame template of a traffic file line, see mgi_line_init() */
+struct line_tpl {
+	struct mgi_hdrs hdrs;         /**< headers of frames to line->dstid */
+	struct mg_hdr mg_hdr;         /**< network-endian mg header; time and line_ctr not set */
+	uint8_t *filler;              /**< payload following the mg header */
+	int filler_len;               /**< filler length */
+};
+
+/** Burst of frames queued to TX worker thread, see _mgi_txw_push() */
+struct mgi_txdesc {
+	struct line *line;                 /**< sending line, may be NULL */
+	struct mgi_hdrs hdrs;              /**< common frame headers */
+	int num;                           /**< number of frames */
+	uint16_t headlen[PKT_BURST_MAX];   /**< lengths of per-frame heads, stored in data one by one */
+	void *tail;                        /**< common tail: line filler or copy in data */
+	size_t taillen;                    /**< tail length */
+	uint8_t ctrl[TXW_CTRL_SIZE];       /**< control messages */
+	size_t ctrllen;                    /**< control messages length */
+	uint8_t data[TXW_DATA_SIZE];       /**< copied frame data */
+};
+
+/** Result of burst sent by TX worker thread */
+struct mgi_txdone {
+	struct line *line;                 /**< sending line, may be NULL */
+	int num;                           /**< number of frames */
+	int ok;                            /**< number of frames sent */
+	uint32_t bytes;                    /**< bytes sent "in the air" */
+	uint32_t full;                     /**< frames not sent due to full TX ring */
+	uint32_t kickerr;                  /**< failed notifications of the kernel, see _mgi_txring_kick() */
+	uint64_t t1;                       /**< start of sending [us] */
+	uint64_t t2;                       /**< end of sending [us] */
+	int err;                           /**< if non-zero: errno that stopped the worker, no burst */
+};
+
+/** TX worker thread of interface
+ * Frame bursts are passed from the main thread in a single-producer/single-consumer ring of desc,
+ * and results are passed back in a similar ring of done. Results are collected into stats by the
+ * main thread after each queued burst, and before writing stats, see mgi_txw_collect(). */
+struct mgi_txw {
+	struct interface *interface;       /**< interface */
+	pthread_t thread;                  /**< worker thread */
+	int cpu;                           /**< CPU to pin to, -1 = no pinning */
+	int efd;                           /**< eventfd waking up the worker */
+	int sleeping;                      /**< worker waits on efd */
+
+	/** main thread side */
+	uint32_t head __attribute__((aligned(64)));  /**< next desc to fill */
+	uint32_t done_tail;                          /**< next done to collect */
+
+	/** worker side */
+	uint32_t tail __attribute__((aligned(64)));  /**< next desc to send */
+	uint32_t done_head;                          /**< next done to fill */
+
+	struct mgi_txdesc desc[TXW_RING_SIZE];
+	struct mgi_txdone done[TXW_RING_SIZE];
+};
+
+/** RX thread of interface
+ * Each thread reads its own socket of a PACKET_FANOUT group and classifies frames into its own
+ * stats shard. Frames destined to us are passed to the main thread in a single-producer/
+ * single-consumer ring, and the main thread is woken up with efd. */
+struct mgi_rxw {
+	struct interface *interface;       /**< interface */
+	pthread_t thread;                  /**< RX thread */
+	int fd;                            /**< fanout socket */
+	int efd;                           /**< eventfd waking up the main thread */
+	struct event ev;                   /**< efd read event */
+	struct mgi_rxframe *frame;         /**< RXW_RING_SIZE classified frames */
+
+	/** RX thread side */
+	uint32_t head __attribute__((aligned(64)));  /**< next frame to fill */
+	struct mgr_cache radio;                      /**< radiotap layout cache of this thread */
+	struct mgi_rxbatch rxbatch;                  /**< recvmmsg() buffers, RXW_BATCH frames */
+
+	/** main thread side */
+	uint32_t tail __attribute__((aligned(64)));  /**< next frame to deliver */
+
+	/** interface stats shard, see stats_shard_add() */
+	stats stats;
+};
+
 /** Received packet info */
 struct sniff_pkt {
 	struct interface *interface;  /**< interface packet arrived on */
-	uint8_t pkt[PKT_BUFSIZE];     /**< raw frame */
+	uint8_t *pkt;                 /**< raw frame */
 	int len;                      /**< length of raw frame */
 	bool dupe;                    /**< if 1, its a duplicate */
+	uint32_t weight;              /**< number of frames this one stands for in interface stats */
 
 	struct {
 		uint64_t tsft;            /**< time [us] */
@@ -268,7 +790,7 @@ struct sniff_pkt {
 		uint8_t  antnum;          /**< antenna number */
 	} radio;
 
-	struct timeval timestamp;     /**< local frame timestamp */
+	struct timeval timestamp;     /**< local frame timestamp, from the kernel if possible */
 	uint8_t srcid;                /**< source id */
 	uint8_t dstid;                /**< destination id */
 	uint16_t size;                /**< total packet size (without radiotap) */
@@ -280,6 +802,18 @@ struct sniff_pkt {
 	struct line *line;            /**< matching line */
 };
 
+/** Frame classified by RX thread, waiting for delivery on the main thread */
+struct mgi_rxframe {
+	struct sniff_pkt pkt;         /**< parsed frame, pkt.pkt points to data on delivery */
+	uint8_t data[PKT_BUFSIZE];    /**< raw frame */
+};
+
+/** Version of struct mg_sync_hdr; messages of other versions or sizes are ignored */
+#define MG_SYNC_VERSION 2
+
+/** Number of latest offers used for the clock offset estimate, see mgc_sync() */
+#define MG_SYNC_OFFSETS 4
+
 /** message sent during time synchronization phase */
 struct mg_sync_hdr {
 	uint32_t code;                /**< code */
@@ -287,9 +821,12 @@ struct mg_sync_hdr {
 #define MG_SYNC_ACK   0xBAAABAAA
 
 	uint8_t  node;                /**< source node */
+	uint8_t  version;             /**< MG_SYNC_VERSION */
 	uint32_t try;                 /**< try number */
 	uint32_t time_s;              /**< start time: seconds */
 	uint32_t time_us;             /**< start time: microseconds */
+	uint32_t sent_s;              /**< master time of sending the offer: seconds */
+	uint32_t sent_us;             /**< master time of sending the offer: microseconds */
 };
 
 /** structure used during synchronization phase */
@@ -307,6 +844,8 @@ struct mg_sync {
 	uint32_t node_count;          /**< number of nodes */
 	uint8_t *exist;               /**< 0 = nonexistent, 1 = exists */
 	uint8_t *acked;               /**< 1 = node acked to time offer (used at master) */
+	int64_t offsets[MG_SYNC_OFFSETS]; /**< clock offset bounds from latest offers (used at slave) */
+	uint32_t offset_num;          /**< number of offers seen, offsets[offset_num % MG_SYNC_OFFSETS] is next */
 };
 
 
@@ -3,13 +3,24 @@
  * IITiS PAN Gliwice
  */
 
+#define _GNU_SOURCE
 #include <endian.h>
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <linux/ethtool.h>
+#include <linux/ptp_clock.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <net/ethernet.h>
 
 #include <libpjf/lib.h>
@@ -20,6 +31,9 @@
 #include "generator.h"
 #include "stats.h"
 #include "dump.h"
+#include "radio.h"
+#include "sync.h"
+#include "clock.h"
 
 static bool _stats_write_interface(struct mg *mg, stats *dst, void *arg)
 {
@@ -30,24 +44,23 @@ static bool _stats_write_interface(struct mg *mg, stats *dst, void *arg)
 static bool _stats_write_link(struct mg *mg, stats *dst, void *arg)
 {
 	stats_aggregate(dst, (stats *) arg);
-	return true;
+
+	/* skip links prepared from traffic file until first frame: rssi is set on each frame */
+	return dst->node[ST_RSSI].type != STATS_NONE;
 }
 
 /*****/
 
 /* Code inspired by hostap.git/wlantest/inject.c */
-int mgi_inject(struct interface *interface,
+static void _mgi_hdrs_fill(struct mgi_hdrs *hdrs,
 	struct ether_addr *bssid, struct ether_addr *dst, struct ether_addr *src, uint8_t rate,
-	uint16_t ether_type, void *data, size_t len)
+	uint16_t ether_type)
 {
-	int ret;
-	struct timeval t1, t2, diff;
-
 	/* radiotap header
 	 * NOTE: this is always LSB!
 	 * SEE: Documentation/networking/mac80211-injection.txt
 	 * SEE: include/net/ieee80211_radiotap.h */
-	uint8_t rtap_hdr[PKT_RADIOTAP_HDRSIZE] = {
+	static const uint8_t rtap_hdr[PKT_RADIOTAP_HDRSIZE] = {
 		0x00, 0x00,             /* radiotap version */
 		0x0a, 0x00,             /* radiotap length */
 		0x00, 0x00, 0x00, 0x00,
@@ -55,12 +68,12 @@ int mgi_inject(struct interface *interface,
 	};
 
 	/* LLC Encapsulated Ethernet header */
-	uint8_t llc_hdr[PKT_LLC_HDRSIZE] = {
-		0xaa, 0xaa, 0x03, 0x00, 0x00, 0x00, PKT_ETHERTYPE >> 8, PKT_ETHERTYPE & 0xff
+	static const uint8_t llc_hdr[PKT_LLC_HDRSIZE] = {
+		0xaa, 0xaa, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00
 	};
 
 	/* 802.11 header - IBSS data frame */
-	uint8_t ieee80211_hdr[PKT_IEEE80211_HDRSIZE] = {
+	static const uint8_t ieee80211_hdr[PKT_IEEE80211_HDRSIZE] = {
 		0x08, 0x00,                         /* Frame Control: data */
 		0x00, 0x00,                         /* Duration */
 		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, /* RA: dst */
@@ -69,385 +82,1952 @@ int mgi_inject(struct interface *interface,
 		0x12, 0x34                          /* seq */
 	};
 
-	/* glue together in an IO vector */
-	struct iovec iov[] = {
-		{
-			.iov_base = &rtap_hdr,
-			.iov_len = sizeof rtap_hdr,
-		},
-		{
-			.iov_base = &ieee80211_hdr,
-			.iov_len = sizeof ieee80211_hdr,
-		},
-		{
-			.iov_base = &llc_hdr,
-			.iov_len = sizeof llc_hdr,
-		},
-		{
-			.iov_base = data,
-			.iov_len = len,
+	memcpy(hdrs->rtap, rtap_hdr, sizeof rtap_hdr);
+	memcpy(hdrs->ieee80211, ieee80211_hdr, sizeof ieee80211_hdr);
+	memcpy(hdrs->llc, llc_hdr, sizeof llc_hdr);
+
+	if (rate) {
+		hdrs->rtap[4] |= (1 << IEEE80211_RADIOTAP_RATE);
+		hdrs->rtap[8]  = rate;
+	}
+
+	memcpy(hdrs->ieee80211 +  4,   dst, sizeof *dst);
+	memcpy(hdrs->ieee80211 + 10,   src, sizeof *src);
+	memcpy(hdrs->ieee80211 + 16, bssid, sizeof *bssid);
+
+	hdrs->llc[6] = ether_type >> 8;
+	hdrs->llc[7] = ether_type & 0xff;
+}
+
+/** Size of a frame after the radiotap header, as counted in snt_ok_bytes */
+static inline uint32_t _mgi_air_size(size_t len)
+{
+	return PKT_HEADERS_SIZE + len + PKT_IEEE80211_FCSSIZE;
+}
+
+/** Inject frames using sendmmsg()
+ * @param bytes    [out] number of bytes successfully sent "in the air"
+ * @return         number of frames successfully sent */
+static int _mgi_sendmmsg_burst(struct interface *interface, struct mgi_hdrs *hdrs,
+	struct iovec *heads, int num, void *tail, size_t taillen, void *ctrl, size_t ctrllen,
+	uint32_t *bytes)
+{
+	struct iovec iov[PKT_BURST_MAX][3];
+	struct mmsghdr msgs[PKT_BURST_MAX];
+	int i, ret, done, ok = 0;
+
+	/* glue together in IO vectors: common headers + per-frame head + common tail */
+	memset(msgs, 0, num * sizeof msgs[0]);
+	for (i = 0; i < num; i++) {
+		iov[i][0].iov_base = hdrs;
+		iov[i][0].iov_len  = sizeof *hdrs;
+		iov[i][1] = heads[i];
+		iov[i][2].iov_base = tail;
+		iov[i][2].iov_len  = taillen;
+
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = N(iov[i]);
+		msgs[i].msg_hdr.msg_control = ctrl;
+		msgs[i].msg_hdr.msg_controllen = ctrllen;
+	}
+
+	for (done = 0; done < num;) {
+		ret = sendmmsg(interface->fd, msgs + done, num - done, MSG_DONTWAIT);
+
+		/* socket buffer full: the rest would fail too, leave it as not sent */
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+			break;
+
+		/* sendmmsg() stops on first failed frame - stop there too, so that frames sent are
+		 * always the first ones, see mgi_sendto_burst() */
+		if (ret <= 0) {
+			dbg(5, "%s: sendmmsg(): %s\n", interface->name, strerror(errno));
+			break;
 		}
-	};
 
-	/* message */
-	struct msghdr msg = {
-		.msg_name = NULL,
-		.msg_namelen = 0,
-		.msg_iov = iov,
-		.msg_iovlen = N(iov),
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0,
-	};
+		for (i = done; i < done + ret; i++)
+			*bytes += _mgi_air_size(heads[i].iov_len + taillen);
+
+		ok += ret;
+		done += ret;
+	}
+
+	return ok;
+}
+
+/** Tell the kernel to send frames waiting in TX ring
+ * @param kickerr  [out] incremented on hard error
+ * @retval false   hard error, frames not picked up by the kernel stay in the ring */
+static bool _mgi_txring_kick(struct interface *interface, struct msghdr *kick, uint32_t *kickerr)
+{
+	if (sendmsg(interface->fd, kick, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+		dbg(1, "%s: TX ring send(): %s\n", interface->name, strerror(errno));
+		(*kickerr)++;
+		return false;
+	}
+
+	return true;
+}
+
+/** Inject frames by writing them directly into TX ring slots and kicking the kernel once
+ * @param bytes    [out] number of bytes successfully sent "in the air"
+ * @param full     [out] number of frames not sent because the ring was full
+ * @param kickerr  [out] number of failed notifications of the kernel
+ * @return         number of frames successfully sent */
+static int _mgi_txring_burst(struct interface *interface, struct mgi_hdrs *hdrs,
+	struct iovec *heads, int num, void *tail, size_t taillen, void *ctrl, size_t ctrllen,
+	uint32_t *bytes, uint32_t *full, uint32_t *kickerr)
+{
+	struct mgi_txring *ring = &interface->txring;
+	struct msghdr kick = { .msg_control = ctrl, .msg_controllen = ctrllen };
+	struct tpacket2_hdr *th;
+	uint8_t *data;
+	uint32_t qbytes = 0;
+	int i, queued = 0;
+	bool kicked = false, failed = false;
+
+	for (i = 0; i < num; i++) {
+		th = (struct tpacket2_hdr *) (ring->map + ring->head * ring->frame_size);
+
+		/* slot still owned by the kernel? push pending frames out and look again */
+		if (*((volatile uint32_t *) &th->tp_status) != TP_STATUS_AVAILABLE) {
+			if (!kicked) {
+				kicked = true;
+				if (!_mgi_txring_kick(interface, &kick, kickerr)) {
+					failed = true;
+					break;
+				}
+			}
+
+			if (*((volatile uint32_t *) &th->tp_status) != TP_STATUS_AVAILABLE) {
+				*full += num - i;
+				break;
+			}
+		}
+
+		/* copy frame into slot */
+		data = (uint8_t *) th + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+		memcpy(data, hdrs, sizeof *hdrs);
+		data += sizeof *hdrs;
+		memcpy(data, heads[i].iov_base, heads[i].iov_len);
+		data += heads[i].iov_len;
+		if (taillen)
+			memcpy(data, tail, taillen);
+
+		th->tp_len = sizeof *hdrs + heads[i].iov_len + taillen;
+
+		/* hand over to the kernel */
+		__sync_synchronize();
+		th->tp_status = TP_STATUS_SEND_REQUEST;
+
+		ring->head = (ring->head + 1) % ring->frame_nr;
+		qbytes += _mgi_air_size(heads[i].iov_len + taillen);
+		queued++;
+	}
+
+	if (queued == 0)
+		return 0;
+
+	/* kick; control messages apply to all frames sent */
+	if (failed || !_mgi_txring_kick(interface, &kick, kickerr)) {
+		/* take back slots the kernel did not pick up - it walks the ring in order, so these
+		 * are the last ones, and ring->head must end up where the kernel will look next */
+		while (queued > 0) {
+			i = (ring->head + ring->frame_nr - 1) % ring->frame_nr;
+			th = (struct tpacket2_hdr *) (ring->map + i * ring->frame_size);
+			if (*((volatile uint32_t *) &th->tp_status) != TP_STATUS_SEND_REQUEST)
+				break;
+
+			th->tp_status = TP_STATUS_AVAILABLE;
+			ring->head = i;
+			queued--;
+			qbytes -= _mgi_air_size(heads[queued].iov_len + taillen);
+		}
+	}
+
+	*bytes += qbytes;
+	return queued;
+}
+
+/** Build SCM_TXTIME control message
+ * Launch times the kernel would find already passed are moved to the earliest safe one.
+ * @param when    launch time, generator time
+ * @param buf     space for CMSG_SPACE(sizeof(uint64_t)) bytes
+ * @return        control message length */
+static size_t _mgi_txtime_cmsg(struct interface *interface, const struct timeval *when, uint8_t *buf)
+{
+	struct msghdr msg = { .msg_control = buf, .msg_controllen = CMSG_SPACE(sizeof(uint64_t)) };
+	struct cmsghdr *cm;
+	struct timeval wall, at;
+	uint64_t ns, earliest;
+
+	/* timer lagged: ETF would drop frames with launch time closer than its delta, which is
+	 * smaller than options.txtime */
+	earliest = mgt_now(interface->mg) + interface->mg->options.txtime;
+	if ((uint64_t) when->tv_sec * 1000000 + when->tv_usec < earliest) {
+		stats_icount(interface->stats, ST_SNT_TXTIME_LATE);
+		at.tv_sec  = earliest / 1000000;
+		at.tv_usec = earliest % 1000000;
+		when = &at;
+	}
+
+	mgt_to_wall(interface->mg, when, &wall);
+	ns = (uint64_t) wall.tv_sec * 1000000000 + wall.tv_usec * 1000 + interface->tai_offset;
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type  = SCM_TXTIME;
+	cm->cmsg_len   = CMSG_LEN(sizeof ns);
+	memcpy(CMSG_DATA(cm), &ns, sizeof ns);
+
+	return msg.msg_controllen;
+}
+
+/** Update interface stats after sending a burst of frames
+ * @param t1       start of sending [us]
+ * @param t2       end of sending [us] */
+static void _mgi_inject_done(struct interface *interface, struct line *line, int num, int ok,
+	uint32_t bytes, uint32_t full, uint32_t kickerr, uint64_t t1, uint64_t t2)
+{
+	struct mgi_txts_slot *slot;
+	int i;
+
+	stats_ihist(interface->stats, ST_SNT_TIME, t2 - t1);
+
+	if (ok > 0) {
+		stats_icountN(interface->stats, ST_SNT_OK, ok);
+		stats_icountN(interface->stats, ST_SNT_OK_BYTES, bytes);
+	}
+	if (ok < num)
+		stats_icountN(interface->stats, ST_SNT_ERR, num - ok);
+	if (full > 0)
+		stats_icountN(interface->stats, ST_SNT_RING_FULL, full);
+	if (kickerr > 0)
+		stats_icountN(interface->stats, ST_SNT_KICK_ERR, kickerr);
+
+	/* remember frames for matching their TX timestamps, see _mgi_errqueue_read() */
+	if (interface->txts.on) {
+		for (i = 0; i < ok; i++) {
+			slot = &interface->txts.slot[interface->txts.next & (TXTS_RING_SIZE - 1)];
+			slot->id = interface->txts.next++;
+			slot->sent.tv_sec  = t1 / 1000000;
+			slot->sent.tv_usec = t1 % 1000000;
+			slot->line = line;
+		}
+	}
+}
+
+/*
+ * TX worker threads
+ */
+
+/** Fall back to sending on the main thread after TX worker thread stopped on error
+ * Bursts still queued to the worker are counted as not sent. */
+static void _mgi_txw_stop(struct interface *interface, int err)
+{
+	struct mgi_txw *w = interface->txw;
+	struct mgi_txdesc *d;
+
+	dbg(0, "%s: TX worker stopped: %s, sending on the main thread\n", interface->name, strerror(err));
+	pthread_join(w->thread, NULL);
+
+	for (; w->tail != w->head; w->tail++) {
+		d = &w->desc[w->tail & (TXW_RING_SIZE - 1)];
+
+		stats_icountN(interface->stats, ST_SNT_ERR, d->num);
+		if (d->line)
+			stats_icountN(d->line->stats, ST_SNT_ERR, d->num);
+	}
+
+	close(w->efd);
+	mmatic_free(w);
+	interface->txw = NULL;
+}
+
+/** Collect results of frames sent by TX worker thread into stats */
+static void _mgi_txw_collect(struct interface *interface)
+{
+	struct mgi_txw *w = interface->txw;
+	struct mgi_txdone *done;
+	uint32_t head;
+
+	head = __atomic_load_n(&w->done_head, __ATOMIC_ACQUIRE);
+	for (; w->done_tail != head; w->done_tail++) {
+		done = &w->done[w->done_tail & (TXW_RING_SIZE - 1)];
+
+		/* the worker exited, no more results will come */
+		if (done->err) {
+			_mgi_txw_stop(interface, done->err);
+			return;
+		}
+
+		_mgi_inject_done(interface, done->line, done->num, done->ok, done->bytes, done->full,
+			done->kickerr, done->t1, done->t2);
+
+		/* mgi_sendto_burst() leaves line stats to us */
+		if (done->line) {
+			if (done->ok > 0)
+				stats_icountN(done->line->stats, ST_SNT_OK, done->ok);
+			if (done->ok < done->num)
+				stats_icountN(done->line->stats, ST_SNT_ERR, done->num - done->ok);
+			stats_ihist(done->line->stats, ST_SNT_TIME, done->t2 - done->t1);
+		}
+	}
+}
+
+/** Queue burst of frames to TX worker thread
+ * Frame data is copied, except for the line filler, which stays in place while sending.
+ * @return         number of frames queued */
+static int _mgi_txw_push(struct interface *interface, struct line *line, struct mgi_hdrs *hdrs,
+	struct iovec *heads, int num, void *tail, size_t taillen, void *ctrl, size_t ctrllen)
+{
+	struct mgi_txw *w = interface->txw;
+	struct mgi_txdesc *d;
+	uint64_t one = 1;
+	size_t len = 0;
+	int i;
+
+	/* all entries waiting for the worker or for _mgi_txw_collect()? keep one done entry for
+	 * the worker to report an error */
+	if (w->head - w->done_tail >= TXW_RING_SIZE - 1) {
+		stats_icountN(interface->stats, ST_SNT_QUEUE_FULL, num);
+		goto drop;
+	}
+
+	d = &w->desc[w->head & (TXW_RING_SIZE - 1)];
+	d->line = line;
+	d->hdrs = *hdrs;
+	d->num  = num;
+
+	for (i = 0; i < num; i++) {
+		if (len + heads[i].iov_len > sizeof d->data)
+			goto toobig;
+
+		memcpy(d->data + len, heads[i].iov_base, heads[i].iov_len);
+		d->headlen[i] = heads[i].iov_len;
+		len += heads[i].iov_len;
+	}
+
+	if (line && line->tpl && tail == line->tpl->filler) {
+		d->tail = tail;
+	} else {
+		if (len + taillen > sizeof d->data)
+			goto toobig;
+
+		d->tail = d->data + len;
+		if (taillen)
+			memcpy(d->tail, tail, taillen);
+	}
+	d->taillen = taillen;
+
+	d->ctrllen = MIN(ctrllen, sizeof d->ctrl);
+	if (d->ctrllen)
+		memcpy(d->ctrl, ctrl, d->ctrllen);
+
+	/* publish, and wake up the worker if it sleeps (pairs with _mgi_txw_main()) */
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+		if (write(w->efd, &one, sizeof one) < 0)
+			dbg(1, "%s: TX worker wakeup: %s\n", interface->name, strerror(errno));
+	}
+
+	/* account bursts the worker finished meanwhile, so that stats do not lag behind */
+	_mgi_txw_collect(interface);
+
+	return num;
+
+toobig:
+	dbg(1, "%s: frame burst too big for TX worker queue\n", interface->name);
+drop:
+	stats_icountN(interface->stats, ST_SNT_ERR, num);
+	if (line)
+		stats_icountN(line->stats, ST_SNT_ERR, num);
+	return 0;
+}
+
+/** TX worker thread: send frame bursts queued by _mgi_txw_push() */
+static void *_mgi_txw_main(void *arg)
+{
+	struct mgi_txw *w = arg;
+	struct interface *interface = w->interface;
+	struct iovec heads[PKT_BURST_MAX];
+	struct mgi_txdesc *d;
+	struct mgi_txdone *done;
+	uint32_t tail, bytes, full, kickerr;
+	uint64_t cnt, t1, t2;
+	uint8_t *data;
+	int i, ok;
+
+	for (;;) {
+		tail = w->tail;
+
+		/* nothing to do: announce we go to sleep, then check again */
+		if (tail == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (tail == __atomic_load_n(&w->head, __ATOMIC_SEQ_CST)) {
+				if (read(w->efd, &cnt, sizeof cnt) < 0 && errno != EINTR)
+					break;
+			}
+			__atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		d = &w->desc[tail & (TXW_RING_SIZE - 1)];
+
+		data = d->data;
+		for (i = 0; i < d->num; i++) {
+			heads[i].iov_base = data;
+			heads[i].iov_len  = d->headlen[i];
+			data += d->headlen[i];
+		}
+
+		bytes = full = kickerr = 0;
+		t1 = mgt_now(interface->mg);
+		if (interface->txring.map)
+			ok = _mgi_txring_burst(interface, &d->hdrs, heads, d->num, d->tail, d->taillen,
+				d->ctrllen ? d->ctrl : NULL, d->ctrllen, &bytes, &full, &kickerr);
+		else
+			ok = _mgi_sendmmsg_burst(interface, &d->hdrs, heads, d->num, d->tail, d->taillen,
+				d->ctrllen ? d->ctrl : NULL, d->ctrllen, &bytes);
+		t2 = mgt_now(interface->mg);
+
+		done = &w->done[w->done_head & (TXW_RING_SIZE - 1)];
+		done->line  = d->line;
+		done->num   = d->num;
+		done->ok    = ok;
+		done->bytes = bytes;
+		done->full  = full;
+		done->kickerr = kickerr;
+		done->t1    = t1;
+		done->t2    = t2;
+		done->err   = 0;
+
+		__atomic_store_n(&w->done_head, w->done_head + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&w->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	/* let the main thread decide what to do, see _mgi_txw_collect() */
+	done = &w->done[w->done_head & (TXW_RING_SIZE - 1)];
+	memset(done, 0, sizeof *done);
+	done->err = errno;
+	__atomic_store_n(&w->done_head, w->done_head + 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/** Prepare TX worker thread of interface, see mgi_start() */
+static void _mgi_txw_init(struct interface *interface, int cpu)
+{
+	struct mgi_txw *w;
+
+	w = mmatic_zalloc(interface->mg->mm, sizeof *w);
+	w->interface = interface;
+	w->cpu = cpu;
+
+	w->efd = eventfd(0, 0);
+	if (w->efd < 0) {
+		dbg(0, "%s: eventfd(): %s\n", interface->name, strerror(errno));
+		mmatic_free(w);
+		return;
+	}
+
+	interface->txw = w;
+}
+
+/*****/
+
+int mgi_inject_hdrs(struct interface *interface, struct line *line, struct mgi_hdrs *hdrs,
+	struct iovec *heads, int num, void *tail, size_t taillen)
+{
+	uint8_t ctrl[CMSG_SPACE(sizeof(uint64_t))];
+	size_t ctrllen = 0;
+	uint32_t bytes = 0, full = 0, kickerr = 0;
+	uint64_t t1, t2;
+	int ok;
+
+	num = MIN(num, PKT_BURST_MAX);
+
+	/* let the kernel release frames at the scheduled moment */
+	if (interface->txtime && line && timerisset(&line->schedule.launch))
+		ctrllen = _mgi_txtime_cmsg(interface, &line->schedule.launch, ctrl);
+
+	/* make room in the queue; this also notices a TX worker that stopped on error */
+	if (interface->txw)
+		_mgi_txw_collect(interface);
+
+	if (interface->txw)
+		return _mgi_txw_push(interface, line, hdrs, heads, num, tail, taillen,
+			ctrllen ? ctrl : NULL, ctrllen);
+
+	t1 = mgt_now(interface->mg);
+	if (interface->txring.map)
+		ok = _mgi_txring_burst(interface, hdrs, heads, num, tail, taillen,
+			ctrllen ? ctrl : NULL, ctrllen, &bytes, &full, &kickerr);
+	else
+		ok = _mgi_sendmmsg_burst(interface, hdrs, heads, num, tail, taillen,
+			ctrllen ? ctrl : NULL, ctrllen, &bytes);
+	t2 = mgt_now(interface->mg);
+
+	_mgi_inject_done(interface, line, num, ok, bytes, full, kickerr, t1, t2);
+	return ok;
+}
+
+int mgi_inject_burst(struct interface *interface,
+	struct ether_addr *bssid, struct ether_addr *dst, struct ether_addr *src, uint8_t rate,
+	uint16_t ether_type, struct iovec *heads, int num, void *tail, size_t taillen)
+{
+	struct mgi_hdrs hdrs;
+
+	_mgi_hdrs_fill(&hdrs, bssid, dst, src, rate, ether_type);
+	return mgi_inject_hdrs(interface, NULL, &hdrs, heads, num, tail, taillen);
+}
+
+int mgi_inject(struct interface *interface,
+	struct ether_addr *bssid, struct ether_addr *dst, struct ether_addr *src, uint8_t rate,
+	uint16_t ether_type, void *data, size_t len)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = len };
+
+	if (mgi_inject_burst(interface, bssid, dst, src, rate, ether_type, &iov, 1, NULL, 0) != 1)
+		return -1;
+
+	return sizeof(struct mgi_hdrs) + len;
+}
+
+/** Fill headers of a frame sent by line to given node */
+static void _mgi_line_hdrs(struct line *line, int dstid, struct mgi_hdrs *hdrs)
+{
+	struct interface *interface = line->interface;
+
+	struct ether_addr bssid  = {{ 0x06, 0xFE, 0xEE, 0xED, 0xFF, interface->num }};
+	struct ether_addr srcmac = {{ 0x06, 0xFE, 0xEE, 0xED, interface->num, line->mg->options.myid }};
+	struct ether_addr dstmac = {{ 0x06, 0xFE, 0xEE, 0xED, interface->num, dstid }};
+
+	/* if NOACK, set broadcast bit */
+	if (line->noack)
+		dstmac.ether_addr_octet[0] |= 0x01;
+
+	_mgi_hdrs_fill(hdrs, &bssid, &dstmac, &srcmac, line->rate, PKT_ETHERTYPE);
+}
+
+/** (Re)build line payload filler of given length */
+static void _mgi_line_filler(struct line *line, int len)
+{
+	struct line_tpl *tpl = line->tpl;
+	int i, j, k;
+
+	if (tpl->filler)
+		mmatic_free(tpl->filler);
+
+	tpl->filler = mmatic_alloc(line->mg->mm, len);
+	tpl->filler_len = len;
+
+	j = strlen(line->contents);
+	for (i = 0; i < len; i += k) {
+		k = MIN(j, len - i);
+		memcpy(tpl->filler + i, line->contents, k);
+	}
+}
+
+void mgi_line_init(struct line *line)
+{
+	struct line_tpl *tpl;
+	int len;
+
+	tpl = mmatic_zalloc(line->mg->mm, sizeof *tpl);
+	line->tpl = tpl;
+
+	_mgi_line_hdrs(line, line->dstid, &tpl->hdrs);
+
+	tpl->mg_hdr.mg_tag   = htonl(MG_TAG_V1);
+	tpl->mg_hdr.line_num = htonl(line->line_num);
+
+	/* filler for the biggest frame this line can send; the TX worker sends it in place,
+	 * so make it fit any frame and never rebuild it */
+	if (line->size_max > 0 && !line->interface->txw)
+		len = line->size_max - PKT_HEADERS_SIZE - PKT_IEEE80211_FCSSIZE - (int) sizeof(struct mg_hdr);
+	else
+		len = PKT_BUFSIZE - sizeof(struct mg_hdr);
+
+	_mgi_line_filler(line, MAX(len, 0));
+}
+
+int mgi_sendto_burst(int dstid, struct line *line, uint8_t *payload, int payload_size, int size,
+	int num)
+{
+	struct line_tpl *tpl = line->tpl;
+	struct mgi_hdrs hdrs_buf, *hdrs;
+	struct mg_hdr mg_hdr[PKT_BURST_MAX];
+	struct iovec heads[PKT_BURST_MAX];
+	uint8_t pkt[PKT_BUFSIZE], *tail;
+	int i, k, done, todo, ok = 0;
+	struct timeval t1, wall, ts;
+	uint64_t t2;
+
+	if (!dstid)
+		dstid = line->dstid;
+
+	dbg(5, "sending line %d: %d->%d size %d x%d\n",
+		line->line_num, line->mg->options.myid, dstid, size, num);
+
+	size -= PKT_HEADERS_SIZE + PKT_IEEE80211_FCSSIZE;
+	if (size < sizeof(struct mg_hdr)) {
+		dbg(0, "pkt too short\n");
+		return 0;
+	} else if (size > PKT_BUFSIZE) {
+		dbg(0, "pkt too long\n");
+		return 0;
+	}
+
+	/* the part after mg header is the same for all frames in burst */
+	size -= sizeof(struct mg_hdr);
+
+	/* the cached filler is built for the biggest frame, so slice it */
+	if (size > tpl->filler_len)
+		_mgi_line_filler(line, size);
+
+	if (payload) {
+		k = MIN(payload_size, size);
+		memcpy(pkt, payload, k);
+		memcpy(pkt + k, tpl->filler, size - k);
+		tail = pkt;
+	} else {
+		tail = tpl->filler;
+	}
+
+	/* use cached headers unless replying to someone else */
+	if (dstid == line->dstid) {
+		hdrs = &tpl->hdrs;
+	} else {
+		_mgi_line_hdrs(line, dstid, &hdrs_buf);
+		hdrs = &hdrs_buf;
+	}
+
+	/* send in chunks of at most PKT_BURST_MAX frames */
+	for (done = 0; done < num; done += todo) {
+		todo = MIN(num - done, PKT_BURST_MAX);
+		mgt_now_tv(line->mg, &t1);
+		mgt_to_wall(line->mg, &t1, &wall);
+		mgc_to_master(line->mg, &wall, &ts);
+
+		/* patch the mg headers */
+		for (i = 0; i < todo; i++) {
+			mg_hdr[i] = tpl->mg_hdr;
+			mg_hdr[i].time_s   = htonl(ts.tv_sec);
+			mg_hdr[i].time_us  = htonl(ts.tv_usec);
+			mg_hdr[i].line_ctr = htonl(++line->line_ctr);
+
+			heads[i].iov_base = &mg_hdr[i];
+			heads[i].iov_len  = sizeof mg_hdr[i];
+		}
+
+		/* send */
+		k = mgi_inject_hdrs(line->interface, line, hdrs, heads, todo, tail, (size_t) size);
+		ok += k;
+
+		/* frames not sent are the last ones: give their counters to next frames, so that
+		 * receivers do not count them as lost */
+		if (k < todo)
+			line->line_ctr -= todo - k;
+
+		/* with TX worker, frames are only queued; see _mgi_txw_collect() */
+		if (line->interface->txw)
+			continue;
+
+		if (k > 0)
+			stats_icountN(line->stats, ST_SNT_OK, k);
+		if (k < todo)
+			stats_icountN(line->stats, ST_SNT_ERR, todo - k);
+
+		t2 = mgt_now(line->mg);
+		stats_ihist(line->stats, ST_SNT_TIME, t2 - ((uint64_t) t1.tv_sec * 1000000 + t1.tv_usec));
+	}
+
+	return ok;
+}
+
+void mgi_sendto(int dstid, struct line *line, uint8_t *payload, int payload_size, int size)
+{
+	mgi_sendto_burst(dstid, line, payload, payload_size, size, 1);
+}
+
+/** Get receive sequence window of given line, source and interface */
+static struct mgi_seqwin *_mgi_seqwin_get(struct line *line, struct interface *interface, uint8_t srcid)
+{
+	struct mgi_seqwin *win;
+
+	for (win = line->seqwin; win; win = win->next) {
+		if (win->srcid == srcid && win->interface == interface)
+			return win;
+	}
+
+	win = mmatic_zalloc(line->mg->mm, sizeof *win);
+	win->interface = interface;
+	win->srcid = srcid;
+	win->size = interface->mg->options.seq_window;
+
+	/* start with counter 0 "received", so that counters below first frame count as lost */
+	win->bits = mmatic_zalloc(line->mg->mm, win->size / 8);
+	memset(win->bits, 0xff, win->size / 8);
+
+	win->next = line->seqwin;
+	line->seqwin = win;
+
+	return win;
+}
+
+/** Clear bits of num counters starting at from, a word at a time
+ * @return number of bits that were set */
+static uint32_t _mgi_seqwin_clear(struct mgi_seqwin *win, uint32_t from, uint32_t num)
+{
+	uint32_t slot, n, set = 0;
+	uint64_t mask;
+
+	slot = from & (win->size - 1);
+	while (num > 0) {
+		n = MIN(num, 64 - (slot & 63));
+		mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << (slot & 63);
+
+		set += __builtin_popcountll(win->bits[slot >> 6] & mask);
+		win->bits[slot >> 6] &= ~mask;
+
+		slot = (slot + n) & (win->size - 1);
+		num -= n;
+	}
+
+	return set;
+}
+
+/** Classify received line counter and mark it in the window
+ * @param lost     [out] number of counters that left the window without being received
+ * @return         enum mgi_seq */
+static int _mgi_seq(struct mgi_seqwin *win, uint32_t ctr, uint32_t *lost)
+{
+	int32_t d = ctr - win->top;
+	uint32_t slot, k;
+	uint64_t bit;
+
+	*lost = 0;
+	slot = ctr & (win->size - 1);
+	bit = 1ULL << (slot & 63);
+
+	if (d > 0) {
+		/* slide: counters top+1..ctr take over slots of the oldest ones; these are lost if unset */
+		k = MIN((uint32_t) d, win->size);
+		*lost = k - _mgi_seqwin_clear(win, win->top + 1, k);
+		if ((uint32_t) d > win->size)
+			*lost += d - win->size;
+
+		win->bits[slot >> 6] |= bit;
+		win->top = ctr;
+
+		/* closed part left the window */
+		if (win->closed && win->top - win->floor >= win->size)
+			win->closed = false;
+
+		return MGI_SEQ_NEW;
+	} else if (win->closed && (int32_t) (ctr - win->floor) <= 0) {
+		return MGI_SEQ_LATE;
+	} else if (d > -(int32_t) win->size) {
+		if (win->bits[slot >> 6] & bit)
+			return MGI_SEQ_DUP;
+
+		win->bits[slot >> 6] |= bit;
+		return MGI_SEQ_REORDER;
+	} else {
+		return MGI_SEQ_LATE;
+	}
+}
+
+/** Parse captured frame and account it in interface stats
+ * Touches only ifstats and radio, so that it can run in RX threads.
+ * @param pkt      frame with interface, weight, pkt, len and timestamp set
+ * @param ifstats  interface stats to use
+ * @param radio    radiotap layout cache to use
+ * @retval true    frame destined to our line, pkt is fully parsed */
+static bool _mgi_classify(struct sniff_pkt *pkt, stats *ifstats, struct mgr_cache *radio)
+{
+	struct interface *interface = pkt->interface;
+	int rtap_len;
+	struct mgr_layout *layout;
+	uint8_t *ieee80211_hdr;
+	struct mg_hdr *mg_hdr;
+
+	/*
+	 * parse radiotap header
+	 */
+	rtap_len = mgr_len(pkt);
+	if (rtap_len < 0) {
+		dbg(1, "invalid radiotap header\n");
+		return false;
+	}
+
+	pkt->size = pkt->len - rtap_len;
+	ieee80211_hdr = (uint8_t *) pkt->pkt + rtap_len;
+
+	if (interface->mg->options.dump) {
+		/* if frame not a beacon OR option "dump beacons" is on */
+		if (ieee80211_hdr[0] != 0x80 || interface->mg->options.dumpb)
+			mgd_dump(pkt);
+	}
+
+	/* decode only fields needed for classification; the rest after 802.11 header checks */
+	if (mgr_decode(radio, pkt, &layout) < 0)
+		return false;
+
+	if (pkt->radio.flags.cfp)
+		stats_icountN(ifstats, ST_RCV_CFP, pkt->weight);
+	if (pkt->radio.flags.shortpre)
+		stats_icountN(ifstats, ST_RCV_SHORTPRE, pkt->weight);
+	if (pkt->radio.flags.frag)
+		stats_icountN(ifstats, ST_RCV_FRAG, pkt->weight);
+	if (pkt->radio.flags.badfcs)
+		stats_icountN(ifstats, ST_RCV_BADFCS, pkt->weight);
+
+	/* loopback filter */
+	if (pkt->radio.tsft == 0)
+		return false;
+
+	stats_icountN(ifstats, ST_RCV_ALL, pkt->weight);
+	stats_icountN(ifstats, ST_RCV_ALL_BYTES, pkt->size * pkt->weight);
+
+	if (pkt->radio.flags.badfcs) {
+		dbg(9, "skipping bad FCS frame\n");
+		return false;
+	}
+
+	/*
+	 * parse IEEE 802.11 header
+	 */
+	if (pkt->size < PKT_IEEE80211_HDRSIZE) {
+		if (pkt->size == PKT_IEEE80211_ACKSIZE) {
+			stats_icountN(ifstats, ST_RCV_ACK, pkt->weight);
+		} else {
+			dbg(1, "skipping invalid short frame (%d)\n", pkt->size);
+			stats_icountN(ifstats, ST_RCV_ALIENS, pkt->weight);
+		}
+
+		return false;
+	}
+
+	pkt->dstid = ieee80211_hdr[9];
+	pkt->srcid = ieee80211_hdr[15];
+
+	/* skip non-data frames */
+	if (ieee80211_hdr[0] != 0x08) {
+		if (ieee80211_hdr[0] == 0x80) {
+			stats_icountN(ifstats, ST_RCV_BEACONS, pkt->weight);
+		} else {
+			stats_icountN(ifstats, ST_RCV_NONDATA, pkt->weight);
+		}
+
+		return false;
+	}
+
+	/* count ieee802.11 data retries */
+	if (ieee80211_hdr[1] & 0x08)
+		stats_icountN(ifstats, ST_RCV_RETRY, pkt->weight);
+
+	/* skip invalid BSSID */
+	if (!(ieee80211_hdr[16] == 0x06 &&
+	      ieee80211_hdr[17] == 0xFE &&
+	      ieee80211_hdr[18] == 0xEE &&
+	      ieee80211_hdr[19] == 0xED &&
+	      ieee80211_hdr[20] == 0xFF)) {
+		dbg(9, "skipping invalid bssid frame\n");
+		stats_icountN(ifstats, ST_RCV_WRONG_BSSID, pkt->weight);
+		return false;
+	}
+
+	/* skip cross-channel transmissions */
+	if (!(ieee80211_hdr[21] == interface->num)) {
+		dbg(9, "skipping cross-channel frame\n");
+		stats_icountN(ifstats, ST_RCV_WRONG_CHANNEL, pkt->weight);
+		return false;
+	}
+
+	/* drop frames not destined to us */
+	if (pkt->dstid != interface->mg->options.myid) {
+		dbg(9, "skipping not ours frame (%d)\n", pkt->dstid);
+		stats_icountN(ifstats, ST_RCV_WRONG_DST, pkt->weight);
+		return false;
+	}
+
+	/*
+	 * parse mg header
+	 */
+	if (pkt->size < PKT_HEADERS_SIZE + PKT_IEEE80211_FCSSIZE + sizeof *mg_hdr) {
+		dbg(11, "skipping short alien frame\n");
+		stats_icount(ifstats, ST_RCV_ALIENS);
+		return false;
+	}
+
+	mg_hdr = (struct mg_hdr *) (pkt->pkt + rtap_len + PKT_HEADERS_SIZE);
+#define A(field) pkt->mg_hdr.field = ntohl(mg_hdr->field)
+	A(mg_tag);
+	A(time_s);
+	A(time_us);
+	A(line_num);
+	A(line_ctr);
+#undef A
+
+	if (pkt->mg_hdr.mg_tag != MG_TAG_V1) {
+		dbg(8, "skipping invalid mg tag alien frame (%x)\n", pkt->mg_hdr.mg_tag);
+		stats_icount(ifstats, ST_RCV_ALIENS);
+		return false;
+	}
+
+	if (pkt->mg_hdr.line_num >= TRAFFIC_LINE_MAX) {
+		dbg(1, "received too high line number (%d) - alien?\n", pkt->mg_hdr.line_num);
+		stats_icount(ifstats, ST_RCV_ALIENS);
+		return false;
+	}
+
+	/* find relevant line object */
+	pkt->line = interface->mg->lines[pkt->mg_hdr.line_num];
+
+	if (!pkt->line) {
+		dbg(1, "received invalid line number (%d) - alien?\n", pkt->mg_hdr.line_num);
+		stats_icount(ifstats, ST_RCV_ALIENS);
+		return false;
+	}
+
+	/*
+	 * XXX: now frame is more or less "verified"
+	 */
+
+	mgr_decode_rest(layout, pkt);
+
+	dbg(8, "frame: tsft=%llu rate=%u freq=%u rssi=%d size=%u\n",
+		pkt->radio.tsft, pkt->radio.rate / 2, pkt->radio.freq, pkt->radio.rssi, pkt->size);
+
+	return true;
+}
+
+/** Account frame classified by _mgi_classify() in line and link stats, and pass it to higher layers
+ * Runs on the main thread. */
+static void _mgi_deliver(struct sniff_pkt *pkt)
+{
+	struct interface *interface = pkt->interface;
+	int seq;
+	uint32_t lost;
+	int64_t delay;
+	struct timeval tv;
+	struct mgi_seqwin *win;
+	stats *ifstats, *linestats, *linkstats;
+
+	ifstats = interface->stats;
+
+	/* store time of last frame destined to us */
+	mgt_from_wall(interface->mg, &pkt->timestamp, &interface->mg->last);
+
+	stats_icount(ifstats, ST_RCV_OK);
+	stats_icountN(ifstats, ST_RCV_OK_BYTES, pkt->size);
+
+	/* get stats */
+	linestats = pkt->line->stats;
+	linkstats = mgi_linkstats_get(interface, pkt->srcid, pkt->dstid);
+
+	/* handle duplicates; dont drop them - may be needed for stats */
+	win = _mgi_seqwin_get(pkt->line, interface, pkt->srcid);
+	win->linkstats = linkstats;
+	win->last = interface->mg->last;
+	seq = _mgi_seq(win, pkt->mg_hdr.line_ctr, &lost);
+
+	if (lost > 0) {
+		stats_icountN(linkstats, ST_RCV_LOST, lost);
+		stats_icountN(linestats, ST_RCV_LOST, lost);
+	}
+
+	switch (seq) {
+		case MGI_SEQ_REORDER:
+			stats_icount(linkstats, ST_RCV_REORDER);
+			stats_icount(linestats, ST_RCV_REORDER);
+			/* fall-through */
+
+		case MGI_SEQ_NEW:
+			stats_icount(linkstats, ST_RCV_OK);
+			stats_icountN(linkstats, ST_RCV_OK_BYTES, pkt->size);
+
+			stats_icount(linestats, ST_RCV_OK);
+			stats_icountN(linestats, ST_RCV_OK_BYTES, pkt->size);
+
+			/* one-way delay, both times in master timebase */
+			mgc_to_master(interface->mg, &pkt->timestamp, &tv);
+			delay  = ((int64_t) tv.tv_sec - pkt->mg_hdr.time_s) * 1000000;
+			delay += (int64_t) tv.tv_usec - pkt->mg_hdr.time_us;
+			if (delay < 0) {
+				/* frame received before it was sent: clock offset estimate or timestamp is off */
+				stats_icount(linkstats, ST_RCV_DELAY_NEG);
+				stats_icount(linestats, ST_RCV_DELAY_NEG);
+			} else {
+				if (delay > UINT32_MAX)
+					delay = UINT32_MAX;
+
+				stats_ihist(linkstats, ST_RCV_DELAY, delay);
+				stats_ihist(linestats, ST_RCV_DELAY, delay);
+			}
+			break;
+
+		case MGI_SEQ_LATE:
+			stats_icount(linkstats, ST_RCV_LATE);
+			stats_icount(linestats, ST_RCV_LATE);
+			break;
+
+		case MGI_SEQ_DUP:
+			pkt->dupe = 1;
+
+			stats_icount(linkstats, ST_RCV_DUP);
+			stats_icountN(linkstats, ST_RCV_DUP_BYTES, pkt->size);
+
+			stats_icount(linestats, ST_RCV_DUP);
+			stats_icountN(linestats, ST_RCV_DUP_BYTES, pkt->size);
+			break;
+	}
+
+	stats_imean(linkstats, ST_RSSI, pkt->radio.rssi);
+	stats_imean(linkstats, ST_RATE, pkt->radio.rate / 2);
+	stats_imean(linkstats, ST_ANTNUM, pkt->radio.antnum);
+
+	pkt->payload = pkt->pkt + (pkt->len - pkt->size) + PKT_HEADERS_SIZE + sizeof(struct mg_hdr);
+	pkt->paylen  = pkt->size - PKT_HEADERS_SIZE - PKT_IEEE80211_FCSSIZE;
+
+	/* pass to higher layers */
+	interface->mg->packet_cb(pkt);
+}
+
+/** Parse and account a single captured frame
+ * @param pkt    frame with interface, weight, pkt, len and timestamp set */
+static void _mgi_handle(struct sniff_pkt *pkt)
+{
+	if (_mgi_classify(pkt, pkt->interface->stats, &pkt->interface->radio))
+		_mgi_deliver(pkt);
+}
+
+/** Convert hardware timestamp made by card clock to wall clock */
+static void _mgi_phc_to_wall(struct interface *interface, int64_t sec, int64_t nsec, struct timeval *tv)
+{
+	int64_t ns;
+
+	ns  = sec * 1000000000 + nsec;
+	ns += interface->phc_offset[__atomic_load_n(&interface->phc_cur, __ATOMIC_ACQUIRE)];
+
+	tv->tv_sec  = ns / 1000000000;
+	tv->tv_usec = (ns % 1000000000) / 1000;
+}
+
+/** Get frame receive timestamp from control messages, or current time if there is none */
+static void _mgi_timestamp(struct interface *interface, struct msghdr *msg, struct timeval *tv)
+{
+	struct cmsghdr *cm;
+	struct timespec *ts;
+
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET)
+			continue;
+
+		ts = (struct timespec *) CMSG_DATA(cm);
+		if (cm->cmsg_type == SO_TIMESTAMPING) {
+			/* ts[0] = software, ts[2] = raw hardware, on the card clock */
+			if (interface->phc_fd > 0 && (ts[2].tv_sec || ts[2].tv_nsec)) {
+				_mgi_phc_to_wall(interface, ts[2].tv_sec, ts[2].tv_nsec, tv);
+				return;
+			} else if (!ts[0].tv_sec && !ts[0].tv_nsec) {
+				continue;
+			}
+		} else if (cm->cmsg_type != SO_TIMESTAMPNS) {
+			continue;
+		}
+
+		tv->tv_sec  = ts->tv_sec;
+		tv->tv_usec = ts->tv_nsec / 1000;
+		return;
+	}
+
+	gettimeofday(tv, NULL);
+}
+
+/** Read the socket error queue: TX timestamps of sent frames, and frames dropped by ETF */
+static void _mgi_errqueue_read(struct interface *interface)
+{
+	uint8_t ctrl[PKT_CMSG_SIZE];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct timespec *ts;
+	struct sock_extended_err *ee;
+	struct mgi_txts_slot *slot;
+	struct timeval wall, tv;
+	int64_t delay;
+	int id;
+
+	for (;;) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof ctrl;
+
+		if (recvmsg(interface->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		ts = NULL;
+		ee = NULL;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMPING)
+				ts = (struct timespec *) CMSG_DATA(cm);
+			else if (cm->cmsg_level == SOL_PACKET && cm->cmsg_type == PACKET_TX_TIMESTAMP)
+				ee = (struct sock_extended_err *) CMSG_DATA(cm);
+		}
+
+		/* frame dropped because of its launch time */
+		if (ee && ee->ee_origin == SO_EE_ORIGIN_TXTIME) {
+			dbg(5, "%s: frame dropped by launch time: %s (code %u)\n", interface->name,
+				strerror(ee->ee_errno), ee->ee_code);
+			stats_icount(interface->stats, ST_SNT_TXTIME_DROP);
+			continue;
+		}
+
+		if (!ts || !ee || ee->ee_errno != ENOMSG || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+			continue;
+
+		/* frame already forgotten, or keys out of step: the kernel also gives keys to frames
+		 * which then fail to send, eg. in a partial burst; follow it, so that frames sent
+		 * from now on match again */
+		slot = &interface->txts.slot[ee->ee_data & (TXTS_RING_SIZE - 1)];
+		if (slot->id != ee->ee_data || slot->sent.tv_sec == 0) {
+			stats_icount(interface->stats, ST_SNT_TXTS_MISS);
+			if ((int32_t) (ee->ee_data - interface->txts.next) >= 0)
+				interface->txts.next = ee->ee_data + 1;
+			continue;
+		}
+
+		/* kernel timestamps are wall clock */
+		wall.tv_sec  = ts[0].tv_sec;
+		wall.tv_usec = ts[0].tv_nsec / 1000;
+		mgt_from_wall(interface->mg, &wall, &tv);
+
+		delay  = ((int64_t) tv.tv_sec - slot->sent.tv_sec) * 1000000;
+		delay += tv.tv_usec - slot->sent.tv_usec;
+		delay  = MAX(0, MIN(delay, UINT32_MAX));
+
+		switch (ee->ee_info) {
+			case SCM_TSTAMP_SCHED: id = ST_SNT_SCHED; break;
+			case SCM_TSTAMP_SND:   id = ST_SNT_QDELAY; break;
+			default:               continue;
+		}
+
+		stats_ihist(interface->stats, id, delay);
+		if (slot->line)
+			stats_ihist(slot->line->stats, id, delay);
+	}
+}
+
+/** Handle error queue wakeups of interface socket not used for RX */
+static void _mgi_sniff_errqueue(int fd, short event, void *arg)
+{
+	_mgi_errqueue_read(arg);
+}
+
+/** Receive a single frame using recvmsg() */
+static void _mgi_sniff(int fd, short event, void *arg)
+{
+	static uint8_t buf[PKT_BUFSIZE];
+	static uint8_t ctrl[PKT_CMSG_SIZE];
+	struct sniff_pkt pkt;
+	struct iovec iov = { buf, PKT_BUFSIZE };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = ctrl, .msg_controllen = sizeof ctrl };
+
+	memset((void *) &pkt, 0, sizeof pkt);
+	pkt.interface = arg;
+	pkt.weight = 1;
+	pkt.pkt = buf;
+
+	/* error queue wakes us up too */
+	if (pkt.interface->errqueue)
+		_mgi_errqueue_read(pkt.interface);
+
+	pkt.len = recvmsg(fd, &msg, MSG_DONTWAIT);
+	if (pkt.len <= 0) {
+		if (errno != EAGAIN)
+			dbg(1, "recvmsg(): %s\n", strerror(errno));
+		return;
+	}
+
+	_mgi_timestamp(pkt.interface, &msg, &pkt.timestamp);
+	_mgi_handle(&pkt);
+}
+
+/** Receive frames in batches using recvmmsg(), until the socket is drained */
+static void _mgi_sniff_batch(int fd, short event, void *arg)
+{
+	struct interface *interface = arg;
+	struct mgi_rxbatch *rb = &interface->rxbatch;
+	struct sniff_pkt pkt;
+	int i, n, total = 0;
+
+	/* error queue wakes us up too */
+	if (interface->errqueue)
+		_mgi_errqueue_read(interface);
+
+	do {
+		/* kernel shrinks msg_controllen to what it used */
+		for (i = 0; i < rb->num; i++)
+			rb->msgs[i].msg_hdr.msg_controllen = PKT_CMSG_SIZE;
+
+		n = recvmmsg(fd, rb->msgs, rb->num, MSG_DONTWAIT, NULL);
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN)
+				dbg(1, "recvmmsg(): %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			memset((void *) &pkt, 0, sizeof pkt);
+			pkt.interface = interface;
+			pkt.weight = 1;
+			pkt.pkt = rb->iov[i].iov_base;
+			pkt.len = rb->msgs[i].msg_len;
+			_mgi_timestamp(interface, &rb->msgs[i].msg_hdr, &pkt.timestamp);
+
+			_mgi_handle(&pkt);
+		}
+
+		total += n;
+	} while (n == rb->num);
+
+	/* batch size histogram: log2 buckets */
+	if (total > 0) {
+		for (i = 0; i < ST_RCV_BATCH_LAST - ST_RCV_BATCH_1 && (total >> (i + 1)); i++);
+		stats_icount(interface->stats, ST_RCV_BATCH_1 + i);
+	}
+}
+
+/** Receive frames sampled by the inverse in-kernel filter; each one stands for options.filter_sample frames */
+static void _mgi_sniff_sample(int fd, short event, void *arg)
+{
+	static uint8_t buf[PKT_BUFSIZE];
+	static uint8_t ctrl[PKT_CMSG_SIZE];
+	struct interface *interface = arg;
+	struct sniff_pkt pkt;
+	struct iovec iov = { buf, PKT_BUFSIZE };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl };
+
+	for (;;) {
+		memset((void *) &pkt, 0, sizeof pkt);
+		pkt.interface = interface;
+		pkt.weight = interface->mg->options.filter_sample;
+		pkt.pkt = buf;
+
+		msg.msg_controllen = sizeof ctrl;
+		pkt.len = recvmsg(fd, &msg, MSG_DONTWAIT);
+		if (pkt.len <= 0) {
+			if (errno != EAGAIN)
+				dbg(1, "recvmsg(): %s\n", strerror(errno));
+			return;
+		}
+
+		_mgi_timestamp(interface, &msg, &pkt.timestamp);
+		_mgi_handle(&pkt);
+	}
+}
+
+/** Walk all RX ring blocks released by the kernel, handling frames in place */
+static void _mgi_sniff_ring(int fd, short event, void *arg)
+{
+	struct interface *interface = arg;
+	struct mgi_rxring *ring = &interface->rxring;
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *th;
+	struct sniff_pkt pkt;
+	uint32_t i;
+
+	for (;;) {
+		bd = (struct tpacket_block_desc *) (ring->map + ring->block * ring->block_size);
+		if (!(*((volatile uint32_t *) &bd->hdr.bh1.block_status) & TP_STATUS_USER))
+			break;
+
+		__sync_synchronize();
+
+		th = (struct tpacket3_hdr *) ((uint8_t *) bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			memset((void *) &pkt, 0, sizeof pkt);
+			pkt.interface = interface;
+			pkt.weight = 1;
+			pkt.pkt = (uint8_t *) th + th->tp_mac;
+			pkt.len = th->tp_snaplen;
+			if (th->tp_status & TP_STATUS_TS_RAW_HARDWARE) {
+				_mgi_phc_to_wall(interface, th->tp_sec, th->tp_nsec, &pkt.timestamp);
+			} else {
+				pkt.timestamp.tv_sec  = th->tp_sec;
+				pkt.timestamp.tv_usec = th->tp_nsec / 1000;
+			}
+
+			_mgi_handle(&pkt);
+
+			th = (struct tpacket3_hdr *) ((uint8_t *) th + th->tp_next_offset);
+		}
+
+		/* give block back to the kernel */
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		ring->block = (ring->block + 1) % ring->block_nr;
+	}
+}
+
+/** RX thread: receive frames from fanout socket and queue the ones destined to us, see _mgi_sniff_rxw() */
+static void *_mgi_rxw_main(void *arg)
+{
+	struct mgi_rxw *w = arg;
+	struct interface *interface = w->interface;
+	struct mgi_rxbatch *rb = &w->rxbatch;
+	struct mgi_rxframe *f;
+	struct sniff_pkt pkt;
+	uint64_t one = 1;
+	int i, n, queued;
+
+	for (;;) {
+		/* kernel shrinks msg_controllen to what it used */
+		for (i = 0; i < rb->num; i++)
+			rb->msgs[i].msg_hdr.msg_controllen = PKT_CMSG_SIZE;
+
+		n = recvmmsg(w->fd, rb->msgs, rb->num, MSG_WAITFORONE, NULL);
+		if (n <= 0) {
+			if (n < 0 && errno != EINTR)
+				dbg(1, "%s: RX thread recvmmsg(): %s\n", interface->name, strerror(errno));
+			continue;
+		}
+
+		/* stats of the whole batch are seen at once by stats_aggregate() */
+		stats_write_begin(&w->stats);
+
+		queued = 0;
+		for (i = 0; i < n; i++) {
+			memset((void *) &pkt, 0, sizeof pkt);
+			pkt.interface = interface;
+			pkt.weight = 1;
+			pkt.pkt = rb->iov[i].iov_base;
+			pkt.len = rb->msgs[i].msg_len;
+			_mgi_timestamp(interface, &rb->msgs[i].msg_hdr, &pkt.timestamp);
+
+			if (!_mgi_classify(&pkt, &w->stats, &w->radio))
+				continue;
+
+			if (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) == RXW_RING_SIZE) {
+				stats_icount(&w->stats, ST_RCV_QUEUE_FULL);
+				continue;
+			}
+
+			f = &w->frame[w->head & (RXW_RING_SIZE - 1)];
+			f->pkt = pkt;
+			memcpy(f->data, pkt.pkt, pkt.len);
+
+			__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+			queued++;
+		}
+
+		/* batch size histogram: log2 buckets */
+		for (i = 0; i < ST_RCV_BATCH_LAST - ST_RCV_BATCH_1 && (n >> (i + 1)); i++);
+		stats_icount(&w->stats, ST_RCV_BATCH_1 + i);
+		stats_write_end(&w->stats);
+
+		if (queued > 0 && write(w->efd, &one, sizeof one) < 0)
+			dbg(1, "%s: RX thread wakeup: %s\n", interface->name, strerror(errno));
+	}
+
+	return NULL;
+}
+
+/** Deliver frames queued by RX thread */
+static void _mgi_sniff_rxw(int fd, short event, void *arg)
+{
+	struct mgi_rxw *w = arg;
+	struct mgi_rxframe *f;
+	uint32_t head;
+	uint64_t cnt;
+
+	if (read(fd, &cnt, sizeof cnt) < 0 && errno != EAGAIN)
+		dbg(1, "%s: RX thread eventfd read(): %s\n", w->interface->name, strerror(errno));
+
+	head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+	while (w->tail != head) {
+		f = &w->frame[w->tail & (RXW_RING_SIZE - 1)];
 
-	/******************/
-	if (rate) {
-		rtap_hdr[4] |= (1 << IEEE80211_RADIOTAP_RATE);
-		rtap_hdr[8]  = rate;
+		/* frame was copied, so point pkt at the copy */
+		f->pkt.pkt = f->data;
+		_mgi_deliver(&f->pkt);
+
+		__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
 	}
+}
 
-	memcpy(ieee80211_hdr +  4,   dst, sizeof *dst);
-	memcpy(ieee80211_hdr + 10,   src, sizeof *src);
-	memcpy(ieee80211_hdr + 16, bssid, sizeof *bssid);
+/** Measure offset of system clock to card clock, using the reading that took the shortest time
+ * @retval true   interface->phc_offset updated */
+static bool _mgi_phc_sync(struct interface *interface)
+{
+	struct ptp_sys_offset req;
+	struct ptp_clock_time *t;
+	int64_t sys1, phc, sys2, best = INT64_MAX, offset = 0;
+	int i;
 
-	gettimeofday(&t1, NULL);
-	ret = sendmsg(interface->fd, &msg, MSG_DONTWAIT);
-	gettimeofday(&t2, NULL);
+	memset(&req, 0, sizeof req);
+	req.n_samples = PHC_SAMPLES;
 
-	timersub(&t2, &t1, &diff);
-	stats_countN(interface->stats, "snt_time", diff.tv_sec * 1000000 + diff.tv_usec);
+	if (ioctl(interface->phc_fd, PTP_SYS_OFFSET, &req) < 0) {
+		dbg(1, "%s: ioctl(PTP_SYS_OFFSET): %s\n", interface->name, strerror(errno));
+		return false;
+	}
 
-	if (ret < 0) {
-		stats_count(interface->stats, "snt_err");
-		return -1;
-	} else {
-		stats_count(interface->stats, "snt_ok");
-		stats_countN(interface->stats, "snt_ok_bytes",
-			iov[1].iov_len + iov[2].iov_len + iov[3].iov_len + PKT_IEEE80211_FCSSIZE);
-		return ret;
+	/* ts[] = system, card, system, card, ..., system */
+	for (i = 0; i < req.n_samples; i++) {
+		t = &req.ts[2 * i];
+		sys1 = t[0].sec * 1000000000 + t[0].nsec;
+		phc  = t[1].sec * 1000000000 + t[1].nsec;
+		sys2 = t[2].sec * 1000000000 + t[2].nsec;
+
+		if (sys2 - sys1 < best) {
+			best = sys2 - sys1;
+			offset = sys1 + (sys2 - sys1) / 2 - phc;
+		}
 	}
+
+	/* RX threads read phc_offset[phc_cur]: write the other one, then switch */
+	interface->phc_offset[interface->phc_cur ^ 1] = offset;
+	__atomic_store_n(&interface->phc_cur, interface->phc_cur ^ 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-void mgi_sendto(int dstid, struct line *line, uint8_t *payload, int payload_size, int size)
+/** Open the clock of network card which makes its hardware timestamps
+ * @retval true   interface->phc_fd is open and phc_offset is valid */
+static bool _mgi_phc_open(struct interface *interface, int fd)
 {
-	uint8_t pkt[PKT_BUFSIZE];
-	struct mg_hdr *mg_hdr;
-	struct interface *interface = line->interface;
-	int i, j, k;
-	struct timeval t1, t2, diff;
+	struct ethtool_ts_info info;
+	struct ifreq ifr;
+	char path[32];
 
-	struct ether_addr bssid  = {{ 0x06, 0xFE, 0xEE, 0xED, 0xFF, interface->num }};
-	struct ether_addr srcmac = {{ 0x06, 0xFE, 0xEE, 0xED, interface->num, line->mg->options.myid }};
-	struct ether_addr dstmac = {{ 0x06, 0xFE, 0xEE, 0xED, interface->num, dstid ? dstid : line->dstid }};
+	if (interface->phc_fd > 0)
+		return true;
 
-	dbg(5, "sending line %d: %d->%d size %d\n",
-		line->line_num, srcmac.ether_addr_octet[5], dstmac.ether_addr_octet[5], size);
+	memset(&info, 0, sizeof info);
+	info.cmd = ETHTOOL_GET_TS_INFO;
 
-	gettimeofday(&t1, NULL);
+	memset(&ifr, 0, sizeof ifr);
+	snprintf(ifr.ifr_name, sizeof ifr.ifr_name, "%s", interface->name);
+	ifr.ifr_data = (void *) &info;
 
-	size -= PKT_HEADERS_SIZE + PKT_IEEE80211_FCSSIZE;
-	if (size < sizeof *mg_hdr) {
-		dbg(0, "pkt too short\n");
-		return;
-	} else if (size > PKT_BUFSIZE) {
-		dbg(0, "pkt too long\n");
-		return;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) < 0 || info.phc_index < 0) {
+		dbg(1, "%s: card clock not available, can not use hardware timestamps\n", interface->name);
+		return false;
 	}
 
-	/* if NOACK, set broadcast bit */
-	if (line->noack)
-		dstmac.ether_addr_octet[0] |= 0x01;
+	snprintf(path, sizeof path, "/dev/ptp%d", info.phc_index);
+	interface->phc_fd = open(path, O_RDONLY);
+	if (interface->phc_fd < 0) {
+		dbg(1, "%s: %s: %s\n", interface->name, path, strerror(errno));
+		interface->phc_fd = 0;
+		return false;
+	}
 
-	/* fill the header */
-	mg_hdr = (void *) pkt;
-	mg_hdr->mg_tag   = htonl(MG_TAG_V1);
-	mg_hdr->time_s   = htonl(t1.tv_sec);
-	mg_hdr->time_us  = htonl(t1.tv_usec);
-	mg_hdr->line_num = htonl(line->line_num);
-	mg_hdr->line_ctr = htonl(++line->line_ctr);
+	if (!_mgi_phc_sync(interface)) {
+		close(interface->phc_fd);
+		interface->phc_fd = 0;
+		return false;
+	}
 
-	/* fill the rest */
-	i = sizeof *mg_hdr;
+	dbg(1, "%s: converting hardware timestamps using %s\n", interface->name, path);
+	return true;
+}
 
-	if (payload) {
-		k = MIN(payload_size, size - i);
-		memcpy(pkt+i, payload, k);
-		i += k;
+/** Ask the kernel for receive timestamps on interface socket
+ * Prefers SO_TIMESTAMPING (with hardware timestamps if options.hwts), falls back to SO_TIMESTAMPNS.
+ * On RX ring sockets, timestamps are always given in frame headers. */
+static void _mgi_timestamp_init(struct interface *interface, int fd, bool ring)
+{
+	struct hwtstamp_config hwc;
+	struct ifreq ifr;
+	int val;
+
+	val = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+	/* hardware timestamps are only usable if they can be converted to system time */
+	if (interface->mg->options.hwts && _mgi_phc_open(interface, fd)) {
+		memset(&hwc, 0, sizeof hwc);
+		hwc.tx_type = HWTSTAMP_TX_OFF;
+		hwc.rx_filter = HWTSTAMP_FILTER_ALL;
+
+		memset(&ifr, 0, sizeof ifr);
+		snprintf(ifr.ifr_name, sizeof ifr.ifr_name, "%s", interface->name);
+		ifr.ifr_data = (void *) &hwc;
+
+		if (ioctl(fd, SIOCSHWTSTAMP, &ifr) < 0)
+			dbg(1, "%s: hardware timestamps not available: %s\n", interface->name, strerror(errno));
+		else
+			val |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
 	}
 
-	j = strlen(line->contents);
-	while (i < size) {
-		k = MIN(j, size - i);
-		memcpy(pkt+i, line->contents, k);
-		i += k;
+	if (ring) {
+		val &= SOF_TIMESTAMPING_RAW_HARDWARE;
+		if (val && setsockopt(fd, SOL_PACKET, PACKET_TIMESTAMP, &val, sizeof val) < 0)
+			dbg(1, "%s: setsockopt(PACKET_TIMESTAMP): %s\n", interface->name, strerror(errno));
+		return;
 	}
 
-	/* send */
-	if (mgi_inject(interface, &bssid, &dstmac, &srcmac, line->rate,
-		PKT_ETHERTYPE, (void *) pkt, (size_t) size) > 0)
-		stats_count(line->stats, "snt_ok");
-	else
-		stats_count(line->stats, "snt_err");
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof val) == 0)
+		return;
 
-	gettimeofday(&t2, NULL);
-	timersub(&t2, &t1, &diff);
-	stats_countN(line->stats, "snt_time", diff.tv_sec * 1000000 + diff.tv_usec);
+	val = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof val) < 0)
+		dbg(1, "%s: no kernel receive timestamps: %s\n", interface->name, strerror(errno));
 }
 
-static void _mgi_sniff(int fd, short event, void *arg)
+/** Start reading the socket error queue of interface
+ * @param rx      true if interface->fd is read by RX event, which then drains the error queue too */
+static void _mgi_errqueue_init(struct interface *interface, bool rx)
 {
-	struct interface *interface = arg;
-	struct sniff_pkt pkt;
-	int n;
-	struct ieee80211_radiotap_iterator parser;
-	uint8_t *ieee80211_hdr;
-	struct mg_hdr *mg_hdr;
-	stats *ifstats, *linestats, *linkstats;
-
-	memset((void *) &pkt, 0, sizeof pkt);
-	gettimeofday(&pkt.timestamp, NULL);
-	pkt.interface = interface;
+	if (interface->errqueue)
+		return;
 
-	ifstats = interface->stats;
+	interface->errqueue = true;
 
-	pkt.len = recvfrom(fd, pkt.pkt, PKT_BUFSIZE, MSG_DONTWAIT, NULL, NULL);
-	if (pkt.len <= 0) {
-		if (errno != EAGAIN)
-			dbg(1, "recvfrom(): %s\n", strerror(errno));
-		return;
+	if (!rx) {
+		event_set(&interface->everr, interface->fd, EV_READ | EV_PERSIST, _mgi_sniff_errqueue, interface);
+		event_add(&interface->everr, NULL);
 	}
+}
 
-	/*
-	 * parse radiotap header
-	 */
-	if (ieee80211_radiotap_iterator_init(&parser, (void *) pkt.pkt, pkt.len) < 0) {
-		dbg(1, "ieee80211_radiotap_iterator_init() failed\n");
+/** Enable launch time of injected frames on interface socket
+ * Frames are released by the ETF qdisc or the driver; launch times are given in CLOCK_TAI.
+ * Frames dropped because of their launch time are reported in the error queue.
+ * @param rx      see _mgi_errqueue_init() */
+static void _mgi_txtime_init(struct interface *interface, bool rx)
+{
+	struct sock_txtime st = { .clockid = CLOCK_TAI, .flags = SOF_TXTIME_REPORT_ERRORS };
+	struct timespec tai, real;
+
+	if (setsockopt(interface->fd, SOL_SOCKET, SO_TXTIME, &st, sizeof st) < 0) {
+		dbg(0, "%s: setsockopt(SO_TXTIME): %s\n", interface->name, strerror(errno));
 		return;
 	}
 
-	pkt.size = pkt.len - parser.max_length;
-	ieee80211_hdr = (uint8_t *) pkt.pkt + parser.max_length;
+	clock_gettime(CLOCK_TAI, &tai);
+	clock_gettime(CLOCK_REALTIME, &real);
+	interface->tai_offset = (int64_t) (tai.tv_sec - real.tv_sec) * 1000000000 +
+		(tai.tv_nsec - real.tv_nsec);
+	interface->tai_offset = (interface->tai_offset + 500000000) / 1000000000 * 1000000000;
 
-	if (interface->mg->options.dump) {
-		/* if frame not a beacon OR option "dump beacons" is on */
-		if (ieee80211_hdr[0] != 0x80 || interface->mg->options.dumpb)
-			mgd_dump(&pkt);
-	}
-
-	while ((n = ieee80211_radiotap_iterator_next(&parser)) == 0) {
-		switch (parser.this_arg_index) {
-			case IEEE80211_RADIOTAP_TSFT:
-				pkt.radio.tsft = le64toh(*((uint64_t *) parser.this_arg));
-				break;
+	interface->txtime = true;
+	_mgi_errqueue_init(interface, rx);
+	dbg(1, "%s: using launch time, TAI offset %llds\n", interface->name,
+		(long long) interface->tai_offset / 1000000000);
+}
 
-			case IEEE80211_RADIOTAP_FLAGS:
-				pkt.radio.flags.val = *parser.this_arg;
+/** Enable TX timestamps on interface socket
+ * Adds to receive timestamp flags already set by _mgi_timestamp_init().
+ * @param rx      true if interface->fd is read by RX event, which then drains the error queue too */
+static void _mgi_txts_init(struct interface *interface, bool rx)
+{
+	int val = 0;
+	socklen_t len = sizeof val;
 
-				if (pkt.radio.flags.val & IEEE80211_RADIOTAP_F_CFP) {
-					pkt.radio.flags.cfp = true;
-					stats_count(ifstats, "rcv_cfp");
-				}
-				if (pkt.radio.flags.val & IEEE80211_RADIOTAP_F_SHORTPRE) {
-					pkt.radio.flags.shortpre = true;
-					stats_count(ifstats, "rcv_shortpre");
-				}
-				if (pkt.radio.flags.val & IEEE80211_RADIOTAP_F_FRAG) {
-					pkt.radio.flags.frag = true;
-					stats_count(ifstats, "rcv_frag");
-				}
-				if (pkt.radio.flags.val & IEEE80211_RADIOTAP_F_BADFCS) {
-					pkt.radio.flags.badfcs = true;
-					stats_count(ifstats, "rcv_badfcs");
-				}
-				break;
+	getsockopt(interface->fd, SOL_SOCKET, SO_TIMESTAMPING, &val, &len);
+	val |= SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
 
-			case IEEE80211_RADIOTAP_RATE:
-				pkt.radio.rate = *(parser.this_arg);
-				break;
+	if (setsockopt(interface->fd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof val) < 0) {
+		dbg(0, "%s: TX timestamps not available: %s\n", interface->name, strerror(errno));
+		return;
+	}
 
-			case IEEE80211_RADIOTAP_CHANNEL:
-				pkt.radio.freq = le16toh(*((uint16_t *) parser.this_arg));
-				/* NB: skip channel flags */
-				break;
+	interface->txts.slot = mmatic_zalloc(interface->mg->mm,
+		TXTS_RING_SIZE * sizeof *interface->txts.slot);
+	interface->txts.on = true;
+	_mgi_errqueue_init(interface, rx);
 
-			case IEEE80211_RADIOTAP_DBM_ANTSIGNAL:
-				pkt.radio.rssi = *((int8_t *) parser.this_arg);
-				break;
+	dbg(1, "%s: reading TX timestamps\n", interface->name);
+}
 
-			case IEEE80211_RADIOTAP_ANTENNA:
-				pkt.radio.antnum = *(parser.this_arg);
-				break;
+/** Setup a memory-mapped TX ring on interface socket
+ * @retval true   success, frames will be written directly into the ring
+ * @retval false  failure, sendmmsg() will be used */
+static bool _mgi_txring_init(struct interface *interface, int frame_nr)
+{
+	struct mgi_txring *ring = &interface->txring;
+	struct tpacket_req req;
+	int val;
+
+	/* each slot must hold tpacket2_hdr + all headers + biggest payload */
+	ring->frame_size = TPACKET_ALIGN(TPACKET2_HDRLEN + sizeof(struct mgi_hdrs) + PKT_BUFSIZE);
+	ring->frame_size = 1 << (32 - __builtin_clz(ring->frame_size - 1));  /* next power of 2 */
+	ring->frame_nr = frame_nr;
+
+	req.tp_block_size = MAX(getpagesize(), ring->frame_size);
+	req.tp_frame_size = ring->frame_size;
+	req.tp_block_nr   = (ring->frame_nr * ring->frame_size + req.tp_block_size - 1) / req.tp_block_size;
+	req.tp_frame_nr   = req.tp_block_nr * (req.tp_block_size / ring->frame_size);
+	ring->frame_nr    = req.tp_frame_nr;
+
+	val = TPACKET_V2;
+	if (setsockopt(interface->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof val) < 0) {
+		dbg(0, "%s: setsockopt(PACKET_VERSION): %s\n", interface->name, strerror(errno));
+		return false;
+	}
 
-			default:
-				dbg(3, "unhandled arg %d value %u\n",
-					parser.this_arg_index, *(parser.this_arg));
-				break;
-		}
-	} if (n != -ENOENT) {
-		dbg(1, "ieee80211_radiotap_iterator_next() failed\n");
-		return;
+	/* dont let a malformed frame block the ring */
+	val = 1;
+	if (setsockopt(interface->fd, SOL_PACKET, PACKET_LOSS, &val, sizeof val) < 0) {
+		dbg(0, "%s: setsockopt(PACKET_LOSS): %s\n", interface->name, strerror(errno));
+		return false;
 	}
 
-	/* loopback filter */
-	if (pkt.radio.tsft == 0)
-		return;
+	if (setsockopt(interface->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof req) < 0) {
+		dbg(0, "%s: setsockopt(PACKET_TX_RING): %s\n", interface->name, strerror(errno));
+		return false;
+	}
 
-	stats_count(ifstats, "rcv_all");
-	stats_countN(ifstats, "rcv_all_bytes", pkt.size);
+	ring->size = req.tp_block_nr * req.tp_block_size;
+	ring->map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, interface->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		dbg(0, "%s: TX ring mmap(): %s\n", interface->name, strerror(errno));
+		ring->map = NULL;
 
-	if (pkt.radio.flags.badfcs) {
-		dbg(9, "skipping bad FCS frame\n");
-		return;
+		/* destroy the ring, so sendmsg() works again */
+		memset(&req, 0, sizeof req);
+		setsockopt(interface->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof req);
+		return false;
 	}
 
-	dbg(8, "frame: tsft=%llu rate=%u freq=%u rssi=%d size=%u\n",
-		pkt.radio.tsft, pkt.radio.rate / 2, pkt.radio.freq, pkt.radio.rssi, pkt.size);
+	ring->head = 0;
+	dbg(1, "%s: using TX ring of %u frames\n", interface->name, ring->frame_nr);
+	return true;
+}
 
-	/*
-	 * parse IEEE 802.11 header
-	 */
-	if (pkt.size < PKT_IEEE80211_HDRSIZE) {
-		if (pkt.size == PKT_IEEE80211_ACKSIZE) {
-			stats_count(ifstats, "rcv_ack");
-		} else {
-			dbg(1, "skipping invalid short frame (%d)\n", pkt.size);
-			stats_count(ifstats, "rcv_aliens");
-		}
+/** Open a raw socket with a memory-mapped TPACKET_V3 RX ring on interface
+ * @param size    ring size [kB]
+ * @retval true   success, frames will be read from interface->rxring
+ * @retval false  failure, recvfrom() on interface->fd will be used */
+static bool _mgi_rxring_init(struct interface *interface, struct sockaddr_ll *ll, int size)
+{
+	struct mgi_rxring *ring = &interface->rxring;
+	struct tpacket_req3 req;
+	int fd, val;
+
+	fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (fd < 0) {
+		dbg(0, "%s: RX ring socket(): %s\n", interface->name, strerror(errno));
+		return false;
+	}
 
-		return;
+	val = TPACKET_V3;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &val, sizeof val) < 0) {
+		dbg(0, "%s: setsockopt(PACKET_VERSION): %s\n", interface->name, strerror(errno));
+		goto fail;
 	}
 
-	pkt.dstid = ieee80211_hdr[9];
-	pkt.srcid = ieee80211_hdr[15];
+	memset(&req, 0, sizeof req);
+	req.tp_block_size = RXRING_BLOCK_SIZE;
+	req.tp_block_nr   = MAX(2, size * 1024 / RXRING_BLOCK_SIZE);
+	req.tp_frame_size = RXRING_FRAME_SIZE;
+	req.tp_frame_nr   = req.tp_block_nr * (RXRING_BLOCK_SIZE / RXRING_FRAME_SIZE);
+	req.tp_retire_blk_tov = RXRING_BLOCK_TIMEOUT;
 
-	/* skip non-data frames */
-	if (ieee80211_hdr[0] != 0x08) {
-		if (ieee80211_hdr[0] == 0x80) {
-			stats_count(ifstats, "rcv_beacons");
-		} else {
-			stats_count(ifstats, "rcv_nondata");
-		}
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) < 0) {
+		dbg(0, "%s: setsockopt(PACKET_RX_RING): %s\n", interface->name, strerror(errno));
+		goto fail;
+	}
 
-		return;
+	ring->size = req.tp_block_nr * req.tp_block_size;
+	ring->map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring->map == MAP_FAILED) {
+		dbg(0, "%s: RX ring mmap(): %s\n", interface->name, strerror(errno));
+		ring->map = NULL;
+		goto fail;
 	}
 
-	/* count ieee802.11 data retries */
-	if (ieee80211_hdr[1] & 0x08)
-		stats_count(ifstats, "rcv_retry");
+	if (bind(fd, (struct sockaddr *) ll, sizeof *ll) < 0) {
+		dbg(0, "%s: RX ring bind(): %s\n", interface->name, strerror(errno));
+		munmap(ring->map, ring->size);
+		ring->map = NULL;
+		goto fail;
+	}
 
-	/* skip invalid BSSID */
-	if (!(ieee80211_hdr[16] == 0x06 &&
-	      ieee80211_hdr[17] == 0xFE &&
-	      ieee80211_hdr[18] == 0xEE &&
-	      ieee80211_hdr[19] == 0xED &&
-	      ieee80211_hdr[20] == 0xFF)) {
-		dbg(9, "skipping invalid bssid frame\n");
-		stats_count(ifstats, "rcv_wrong_bssid");
-		return;
+	ring->fd = fd;
+	ring->block_size = req.tp_block_size;
+	ring->block_nr = req.tp_block_nr;
+	ring->block = 0;
+
+	dbg(1, "%s: using RX ring of %u kB\n", interface->name, (unsigned int) (ring->size / 1024));
+	return true;
+
+fail:
+	close(fd);
+	return false;
+}
+
+/** Prepare buffers for batched receive of up to num frames */
+static void _mgi_rxbatch_init(struct interface *interface, struct mgi_rxbatch *rb, int num)
+{
+	mmatic *mm = interface->mg->mm;
+	int i;
+
+	rb->num  = num;
+	rb->bufs = mmatic_alloc(mm, num * PKT_BUFSIZE);
+	rb->iov  = mmatic_zalloc(mm, num * sizeof *rb->iov);
+	rb->msgs = mmatic_zalloc(mm, num * sizeof *rb->msgs);
+	rb->ctrl = mmatic_zalloc(mm, num * PKT_CMSG_SIZE);
+
+	for (i = 0; i < num; i++) {
+		rb->iov[i].iov_base = rb->bufs + i * PKT_BUFSIZE;
+		rb->iov[i].iov_len  = PKT_BUFSIZE;
+
+		rb->msgs[i].msg_hdr.msg_iov = &rb->iov[i];
+		rb->msgs[i].msg_hdr.msg_iovlen = 1;
+		rb->msgs[i].msg_hdr.msg_control = rb->ctrl + i * PKT_CMSG_SIZE;
 	}
+}
 
-	/* skip cross-channel transmissions */
-	if (!(ieee80211_hdr[21] == interface->num)) {
-		dbg(9, "skipping cross-channel frame\n");
-		stats_count(ifstats, "rcv_wrong_channel");
-		return;
+/** Make socket drop all incoming frames, so it can be used only for TX */
+static void _mgi_drop_all(struct interface *interface)
+{
+	struct sock_filter drop[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+	struct sock_fprog prog = { .len = N(drop), .filter = drop };
+
+	if (setsockopt(interface->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog) < 0)
+		dbg(1, "%s: setsockopt(SO_ATTACH_FILTER): %s\n", interface->name, strerror(errno));
+}
+
+/** Build a classic BPF program passing only data frames destined to this node
+ * Offsets into the 802.11 header are relative to the radiotap header length, read from the frame.
+ * @param f        space for at least MGI_FILTER_MAX instructions
+ * @param sample   if > 0, build the inverse program instead, which passes a random 1/sample of
+ *                 frames rejected by the main program
+ * @return         program length */
+static int _mgi_filter_build(struct interface *interface, struct sock_filter *f, int sample)
+{
+	uint32_t pass = sample ? 0 : 0xffff;
+	uint32_t drop = sample ? 0xffff : 0;
+	int i = 0, c;
+
+	/* 802.11 header bytes to check: offset, value */
+	const uint8_t checks[][2] = {
+		{  0, 0x08 },                      /* Frame Control: data */
+		{ 16, 0x06 }, { 17, 0xFE }, { 18, 0xEE }, { 19, 0xED }, { 20, 0xFF }, /* BSSID */
+		{ 21, interface->num },            /* BSSID: channel */
+		{  9, interface->mg->options.myid }, /* RA: dst */
+	};
+
+	if (sample) {
+		f[i++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM);
+		f[i++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, sample);
+		f[i++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0);
+		f[i++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
 	}
 
-	/* drop frames not destined to us */
-	if (pkt.dstid != interface->mg->options.myid) {
-		dbg(9, "skipping not ours frame (%d)\n", pkt.dstid);
-		stats_count(ifstats, "rcv_wrong_dst");
-		return;
+	/* X = radiotap header length (LSB) */
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 3);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TAX, 0);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 2);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0);
+
+	/* frames too short for the 802.11 header would abort the program - reject them explicitly */
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, PKT_IEEE80211_HDRSIZE);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TAX, 0);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+	f[i++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JGE | BPF_X, 0, 0, 2 * N(checks) + 4);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TXA, 0);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, PKT_IEEE80211_HDRSIZE);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TAX, 0);
+
+	/* compare bytes, jump to drop on first mismatch */
+	for (c = 0; c < N(checks); c++) {
+		f[i++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_IND, checks[c][0]);
+		f[i++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, checks[c][1],
+			0, 2 * (N(checks) - c - 1) + 1);
 	}
 
-	/*
-	 * parse mg header
-	 */
-	if (pkt.size < PKT_HEADERS_SIZE + PKT_IEEE80211_FCSSIZE + sizeof *mg_hdr) {
-		dbg(11, "skipping short alien frame\n");
-		stats_count(ifstats, "rcv_aliens");
-		return;
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, pass);
+	f[i++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, drop);
+
+	return i;
+}
+
+/** Attach BPF program built by _mgi_filter_build() to socket */
+static bool _mgi_filter_attach(struct interface *interface, int fd, int sample)
+{
+	struct sock_filter f[MGI_FILTER_MAX];
+	struct sock_fprog prog = { .filter = f };
+
+	prog.len = _mgi_filter_build(interface, f, sample);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog) < 0) {
+		dbg(0, "%s: setsockopt(SO_ATTACH_FILTER): %s\n", interface->name, strerror(errno));
+		return false;
 	}
 
-	mg_hdr = (struct mg_hdr *) (pkt.pkt + parser.max_length + PKT_HEADERS_SIZE);
-#define A(field) pkt.mg_hdr.field = ntohl(mg_hdr->field)
-	A(mg_tag);
-	A(time_s);
-	A(time_us);
-	A(line_num);
-	A(line_ctr);
-#undef A
+	return true;
+}
+
+/** Open a socket receiving a random sample of frames rejected by the in-kernel filter */
+static void _mgi_sample_init(struct interface *interface, struct sockaddr_ll *ll, int sample)
+{
+	int fd;
 
-	if (pkt.mg_hdr.mg_tag != MG_TAG_V1) {
-		dbg(8, "skipping invalid mg tag alien frame (%x)\n", pkt.mg_hdr.mg_tag);
-		stats_count(ifstats, "rcv_aliens");
+	fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (fd < 0) {
+		dbg(0, "%s: sampling socket(): %s\n", interface->name, strerror(errno));
 		return;
 	}
 
-	if (pkt.mg_hdr.line_num >= TRAFFIC_LINE_MAX) {
-		dbg(1, "received too high line number (%d) - alien?\n", pkt.mg_hdr.line_num);
-		stats_count(ifstats, "rcv_aliens");
+	/* attach filter before bind(), so no unfiltered frame gets queued */
+	if (!_mgi_filter_attach(interface, fd, sample) ||
+	    bind(fd, (struct sockaddr *) ll, sizeof *ll) < 0) {
+		close(fd);
 		return;
 	}
 
-	/* find relevant line object */
-	pkt.line = interface->mg->lines[pkt.mg_hdr.line_num];
+	_mgi_timestamp_init(interface, fd, false);
 
-	if (!pkt.line) {
-		dbg(1, "received invalid line number (%d) - alien?\n", pkt.mg_hdr.line_num);
-		stats_count(ifstats, "rcv_aliens");
-		return;
-	}
+	interface->sample_fd = fd;
+	event_set(&interface->evsample, fd, EV_READ | EV_PERSIST, _mgi_sniff_sample, interface);
+	event_add(&interface->evsample, NULL);
 
-	/*
-	 * XXX: now frame is more or less "verified"
-	 */
+	dbg(1, "%s: sampling 1/%d of filtered frames\n", interface->name, sample);
+}
 
-	/* store time of last frame destined to us */
-	gettimeofday(&interface->mg->last, NULL);
+/** Open a PACKET_FANOUT group of num sockets on interface, each served by its own RX thread
+ * Threads are started by mgi_start().
+ * @param mode     PACKET_FANOUT_HASH or PACKET_FANOUT_CPU
+ * @retval true    at least one socket opened, main interface socket is not needed for RX */
+static bool _mgi_rxw_init(struct interface *interface, struct sockaddr_ll *ll, int num, int mode)
+{
+	struct mg *mg = interface->mg;
+	struct mgi_rxw *w;
+	int i, fd, fanout;
 
-	stats_count(ifstats, "rcv_ok");
-	stats_countN(ifstats, "rcv_ok_bytes", pkt.size);
+	/* group id must be unique among processes and interfaces */
+	fanout = ((getpid() + interface->num) & 0xffff) | (mode << 16);
 
-	/* get stats */
-	linestats = pkt.line->stats;
-	linkstats = mgi_linkstats_get(interface, pkt.srcid, pkt.dstid);
+	interface->rxw = mmatic_zalloc(mg->mm, num * sizeof *interface->rxw);
+	for (i = 0; i < num; i++) {
+		fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+		if (fd < 0) {
+			dbg(0, "%s: RX thread socket(): %s\n", interface->name, strerror(errno));
+			break;
+		}
 
-	/* handle duplicates; dont drop them - may be needed for stats */
-	n  = pkt.mg_hdr.line_ctr;
-	n -= pkt.line->line_ctr_rcv;
-	if (n > 0) {
-		stats_count(linkstats, "rcv_ok");
-		stats_countN(linkstats, "rcv_ok_bytes", pkt.size);
+		/* attach filter before bind(), so no unfiltered frame gets queued */
+		if (mg->options.filter && !_mgi_filter_attach(interface, fd, 0)) {
+			close(fd);
+			break;
+		}
+
+		if (bind(fd, (struct sockaddr *) ll, sizeof *ll) < 0 ||
+		    setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof fanout) < 0) {
+			dbg(0, "%s: PACKET_FANOUT: %s\n", interface->name, strerror(errno));
+			close(fd);
+			break;
+		}
+
+		_mgi_timestamp_init(interface, fd, false);
 
-		stats_count(linestats, "rcv_ok");
-		stats_countN(linestats, "rcv_ok_bytes", pkt.size);
+		w = mmatic_zalloc(mg->mm, sizeof *w);
+		w->interface = interface;
+		w->fd = fd;
+		w->frame = mmatic_alloc(mg->mm, RXW_RING_SIZE * sizeof *w->frame);
 
-		if (n > 1) {
-			stats_countN(linkstats, "rcv_lost", n - 1);
-			stats_countN(linestats, "rcv_lost", n - 1);
+		w->efd = eventfd(0, EFD_NONBLOCK);
+		if (w->efd < 0) {
+			dbg(0, "%s: eventfd(): %s\n", interface->name, strerror(errno));
+			close(fd);
+			mmatic_free(w->frame);
+			mmatic_free(w);
+			break;
 		}
-	} else {
-		pkt.dupe = 1;
 
-		stats_count(linkstats, "rcv_dup");
-		stats_countN(linkstats, "rcv_dup_bytes", pkt.size);
+		_mgi_rxbatch_init(interface, &w->rxbatch, RXW_BATCH);
+
+		/* interface counters of this thread */
+		stats_init(&w->stats, mg->mm);
+		stats_shard_add(interface->stats, &w->stats);
+
+		event_set(&w->ev, w->efd, EV_READ | EV_PERSIST, _mgi_sniff_rxw, w);
+		event_add(&w->ev, NULL);
 
-		stats_count(linestats, "rcv_dup");
-		stats_countN(linestats, "rcv_dup_bytes", pkt.size);
+		interface->rxw[interface->rxw_num++] = w;
 	}
 
-	stats_mean(linkstats, "rssi", pkt.radio.rssi);
-	stats_mean(linkstats, "rate", pkt.radio.rate / 2);
-	stats_mean(linkstats, "antnum", pkt.radio.antnum);
+	if (interface->rxw_num == 0) {
+		mmatic_free(interface->rxw);
+		interface->rxw = NULL;
+		return false;
+	}
 
-	pkt.payload = (uint8_t *) mg_hdr + sizeof *mg_hdr;
-	pkt.paylen  = pkt.size - PKT_HEADERS_SIZE - PKT_IEEE80211_FCSSIZE;
+	dbg(1, "%s: receiving in %d threads\n", interface->name, interface->rxw_num);
+	return true;
+}
 
-	/* pass to higher layers */
-	interface->mg->packet_cb(&pkt);
+/** Register stats file writer of given link */
+static void _mgi_linkstats_writer(struct interface *interface, uint8_t srcid, uint8_t dstid)
+{
+	char filename[64];
+
+	snprintf(filename, sizeof filename, "link-%u->%u.txt", srcid, dstid);
+	mgstats_writer_add(interface->mg, _stats_write_link, interface->linkstats[dstid][srcid],
+		interface->name, filename,
+		"rcv_ok",
+		"rcv_ok_bytes",
+		"rcv_dup",
+		"rcv_dup_bytes",
+		"rcv_lost",
+		"rcv_reorder",
+		"rcv_late",
+		"rssi",
+		"rate",
+		"antnum",
+		"rcv_delay_avg",
+		"rcv_delay_p50",
+		"rcv_delay_p99",
+		"rcv_delay_max",
+		"rcv_delay_neg",
+		NULL);
+}
+
+/** Deferred writer registration of links first seen in mgi_linkstats_get() */
+static void _mgi_linkstats_register(int fd, short evtype, void *arg)
+{
+	struct interface *interface = arg;
+	uint8_t myid = interface->mg->options.myid;
+
+	interface->linkw_pending = false;
+
+	for (int srcid = 0; srcid <= NODE_MAX; srcid++) {
+		if (interface->linkw[srcid] != MGI_LINKW_PENDING)
+			continue;
 
-	pkt.line->line_ctr_rcv = pkt.mg_hdr.line_ctr;
+		dbg(5, "%s: new link %u->%u\n", interface->name, srcid, myid);
+		_mgi_linkstats_writer(interface, srcid, myid);
+		interface->linkw[srcid] = MGI_LINKW_DONE;
+	}
+}
+
+/** Allocate link stats db */
+static stats *_mgi_linkstats_create(struct interface *interface, uint8_t srcid, uint8_t dstid)
+{
+	if (!interface->linkstats[dstid])
+		interface->linkstats[dstid] = mmatic_zalloc(interface->mg->mm,
+			(NODE_MAX+1) * sizeof(stats *));
+
+	if (!interface->linkstats[dstid][srcid])
+		interface->linkstats[dstid][srcid] = stats_create(interface->mg->mm);
+
+	return interface->linkstats[dstid][srcid];
+}
+
+/** Preallocate stats of all links to this node, so that the RX path never allocates */
+static void _mgi_linkstats_init(struct interface *interface)
+{
+	for (int srcid = 0; srcid <= NODE_MAX; srcid++)
+		_mgi_linkstats_create(interface, srcid, interface->mg->options.myid);
+
+	evtimer_set(&interface->evlinkw, _mgi_linkstats_register, interface);
 }
 
 int mgi_init(struct mg *mg, mgi_packet_cb cb)
@@ -462,6 +2042,17 @@ int mgi_init(struct mg *mg, mgi_packet_cb cb)
 
 	mg->packet_cb = cb;
 
+	/* receive sequence window: power of 2, at least one bitmap word */
+	mg->options.seq_window = MAX(SEQ_WINDOW_MIN, MIN(SEQ_WINDOW_MAX, mg->options.seq_window));
+	while (mg->options.seq_window & (mg->options.seq_window - 1))
+		mg->options.seq_window += mg->options.seq_window & -mg->options.seq_window;
+
+	/* frames are dumped during classification, and dump files are not shared between threads */
+	if (mg->options.rxthreads > 0 && mg->options.dump) {
+		dbg(0, "RX threads not supported with dump, receiving on the main thread\n");
+		mg->options.rxthreads = 0;
+	}
+
 	/* open PF_PACKET raw sockets on interfaces */
 	for (int i = 0; i < IFINDEX_MAX; i++) {
 		snprintf(name, sizeof name, IFNAME_FMT, i);
@@ -487,13 +2078,58 @@ int mgi_init(struct mg *mg, mgi_packet_cb cb)
 		mg->interface[i].num = i;
 		mg->interface[i].fd = fd;
 		mg->interface[i].stats = stats_create(mg->mm);
-		mg->interface[i].linkstats = thash_create_strkey(NULL, mg->mm);
+
+		/* fall back to sendmmsg() if TX ring is not available */
+		if (mg->options.txring > 0)
+			_mgi_txring_init(&mg->interface[i], mg->options.txring);
 
 		/* monitor for incoming packets */
-		event_set(&mg->interface[i].evread,
-			fd, EV_READ | EV_PERSIST, _mgi_sniff, &mg->interface[i]);
+		if (mg->options.rxthreads > 0 && _mgi_rxw_init(&mg->interface[i], &ll, mg->options.rxthreads,
+			streq(mg->options.rxfanout, "cpu") ? PACKET_FANOUT_CPU : PACKET_FANOUT_HASH)) {
+			_mgi_drop_all(&mg->interface[i]);
+		} else if (mg->options.rxring > 0 && _mgi_rxring_init(&mg->interface[i], &ll, mg->options.rxring)) {
+			_mgi_drop_all(&mg->interface[i]);
+			_mgi_timestamp_init(&mg->interface[i], mg->interface[i].rxring.fd, true);
+			event_set(&mg->interface[i].evread, mg->interface[i].rxring.fd,
+				EV_READ | EV_PERSIST, _mgi_sniff_ring, &mg->interface[i]);
+		} else if (mg->options.rxbatch > 1) {
+			_mgi_timestamp_init(&mg->interface[i], fd, false);
+			_mgi_rxbatch_init(&mg->interface[i], &mg->interface[i].rxbatch, mg->options.rxbatch);
+			dbg(1, "%s: receiving up to %d frames per wakeup\n", name, mg->options.rxbatch);
+			event_set(&mg->interface[i].evread,
+				fd, EV_READ | EV_PERSIST, _mgi_sniff_batch, &mg->interface[i]);
+		} else {
+			_mgi_timestamp_init(&mg->interface[i], fd, false);
+			event_set(&mg->interface[i].evread,
+				fd, EV_READ | EV_PERSIST, _mgi_sniff, &mg->interface[i]);
+		}
 
-		event_add(&mg->interface[i].evread, NULL);
+		if (!mg->interface[i].rxw)
+			event_add(&mg->interface[i].evread, NULL);
+
+		if (mg->options.txtime > 0)
+			_mgi_txtime_init(&mg->interface[i], !mg->interface[i].rxring.map && !mg->interface[i].rxw);
+
+		/* TX timestamps are matched with frames on the main thread */
+		if (mg->options.txts && mg->options.txthreads)
+			dbg(0, "%s: TX timestamps not supported with TX threads\n", name);
+		else if (mg->options.txts)
+			_mgi_txts_init(&mg->interface[i], !mg->interface[i].rxring.map && !mg->interface[i].rxw);
+
+		if (mg->options.txthreads)
+			_mgi_txw_init(&mg->interface[i], mg->options.txcpu < 0 ? -1 : mg->options.txcpu + count - 1);
+
+		/* let the kernel drop frames not destined to us, unless we need to dump them;
+		 * RX thread sockets got their filter in _mgi_rxw_init() */
+		if (mg->options.filter && !mg->options.dump) {
+			if (mg->interface[i].rxw || _mgi_filter_attach(&mg->interface[i],
+				mg->interface[i].rxring.map ? mg->interface[i].rxring.fd : fd, 0)) {
+				if (mg->options.filter_sample > 0)
+					_mgi_sample_init(&mg->interface[i], &ll, mg->options.filter_sample);
+			}
+		}
+
+		_mgi_linkstats_init(&mg->interface[i]);
 
 		/* interface stats writer */
 		mgstats_writer_add(mg, _stats_write_interface, &mg->interface[i],
@@ -502,6 +2138,20 @@ int mgi_init(struct mg *mg, mgi_packet_cb cb)
 			"snt_ok_bytes",
 			"snt_err",
 			"snt_time",
+			"snt_time_p50",
+			"snt_time_p99",
+			"snt_time_max",
+			"snt_sched_p50",
+			"snt_sched_p99",
+			"snt_qdelay_p50",
+			"snt_qdelay_p99",
+			"snt_qdelay_max",
+			"snt_ring_full",
+			"snt_kick_err",
+			"snt_queue_full",
+			"snt_txtime_late",
+			"snt_txtime_drop",
+			"snt_txts_miss",
 
 			"rcv_all",
 			"rcv_all_bytes",
@@ -519,6 +2169,16 @@ int mgi_init(struct mg *mg, mgi_packet_cb cb)
 			"rcv_aliens",
 			"rcv_ok",
 			"rcv_ok_bytes",
+			"rcv_queue_full",
+
+			"rcv_batch_1",
+			"rcv_batch_2",
+			"rcv_batch_4",
+			"rcv_batch_8",
+			"rcv_batch_16",
+			"rcv_batch_32",
+			"rcv_batch_64",
+			"rcv_batch_128",
 
 			NULL);
 	}
@@ -526,31 +2186,134 @@ int mgi_init(struct mg *mg, mgi_packet_cb cb)
 	return count;
 }
 
+void mgi_start(struct mg *mg)
+{
+	struct mgi_txw *w;
+	cpu_set_t cpus;
+	int i, j, rc;
+
+	for (i = 0; i < IFINDEX_MAX; i++) {
+		for (j = 0; j < mg->interface[i].rxw_num; j++) {
+			rc = pthread_create(&mg->interface[i].rxw[j]->thread, NULL,
+				_mgi_rxw_main, mg->interface[i].rxw[j]);
+			if (rc != 0)
+				die("%s: pthread_create(): %s\n", mg->interface[i].name, strerror(rc));
+		}
+
+		w = mg->interface[i].txw;
+		if (!w)
+			continue;
+
+		rc = pthread_create(&w->thread, NULL, _mgi_txw_main, w);
+		if (rc != 0)
+			die("%s: pthread_create(): %s\n", mg->interface[i].name, strerror(rc));
+
+		if (w->cpu >= 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(w->cpu, &cpus);
+
+			rc = pthread_setaffinity_np(w->thread, sizeof cpus, &cpus);
+			if (rc != 0)
+				dbg(0, "%s: could not pin TX worker to CPU %d: %s\n",
+					mg->interface[i].name, w->cpu, strerror(rc));
+		}
+
+		dbg(1, "%s: started TX worker thread\n", mg->interface[i].name);
+	}
+}
+
+void mgi_txw_collect(struct mg *mg)
+{
+	int i;
+
+	for (i = 0; i < IFINDEX_MAX; i++) {
+		if (mg->interface[i].txw)
+			_mgi_txw_collect(&mg->interface[i]);
+	}
+}
+
+void mgi_linkstats_add(struct interface *interface, uint8_t srcid, uint8_t dstid)
+{
+	if (dstid == interface->mg->options.myid) {
+		if (interface->linkw[srcid] == MGI_LINKW_DONE)
+			return;
+		interface->linkw[srcid] = MGI_LINKW_DONE;
+	} else if (interface->linkstats[dstid] && interface->linkstats[dstid][srcid]) {
+		return;
+	}
+
+	_mgi_linkstats_create(interface, srcid, dstid);
+	_mgi_linkstats_writer(interface, srcid, dstid);
+}
+
 stats *mgi_linkstats_get(struct interface *interface, uint8_t srcid, uint8_t dstid)
 {
-	stats *stats;
-	char key[64], filename[64];
+	struct timeval tv = {0, 0};
 
-	snprintf(key, sizeof key, "%u-%u", srcid, dstid);
-	stats = thash_get(interface->linkstats, key);
+	/* _mgi_classify() delivers only frames to this node, whose links are preallocated */
+	if (dstid != interface->mg->options.myid) {
+		mgi_linkstats_add(interface, srcid, dstid);
+		return interface->linkstats[dstid][srcid];
+	}
 
-	if (!stats) {
-		stats = stats_create(interface->mg->mm);
-		thash_set(interface->linkstats, key, stats);
+	/* link not in traffic file: count now, register writer outside of RX path,
+	 * with at most one pending event per interface */
+	if (interface->linkw[srcid] == MGI_LINKW_NONE) {
+		interface->linkw[srcid] = MGI_LINKW_PENDING;
+		if (!interface->linkw_pending) {
+			interface->linkw_pending = true;
+			evtimer_add(&interface->evlinkw, &tv);
+		}
+	}
 
-		snprintf(filename, sizeof filename, "link-%u->%u.txt", srcid, dstid);
-		mgstats_writer_add(interface->mg, _stats_write_link, stats,
-			interface->name, filename,
-			"rcv_ok",
-			"rcv_ok_bytes",
-			"rcv_dup",
-			"rcv_dup_bytes",
-			"rcv_lost",
-			"rssi",
-			"rate",
-			"antnum",
-			NULL);
+	return interface->linkstats[dstid][srcid];
+}
+
+void mgi_seq_expire(struct mg *mg)
+{
+	struct mgi_seqwin *win;
+	struct timeval now, diff;
+	uint32_t lost;
+	int i, w;
+
+	mgt_now_tv(mg, &now);
+
+	for (i = 1; i < TRAFFIC_LINE_MAX; i++) {
+		if (!mg->lines[i])
+			continue;
+
+		for (win = mg->lines[i]->seqwin; win; win = win->next) {
+			if (win->closed && win->floor == win->top)
+				continue;
+
+			timersub(&now, &win->last, &diff);
+			if (diff.tv_sec < SEQ_IDLE)
+				continue;
+
+			/* counters missing from the window will not come anymore */
+			lost = 0;
+			for (w = 0; w < win->size / 64; w++) {
+				lost += 64 - __builtin_popcountll(win->bits[w]);
+				win->bits[w] = ~0ULL;
+			}
+
+			if (lost > 0) {
+				stats_icountN(win->linkstats, ST_RCV_LOST, lost);
+				stats_icountN(mg->lines[i]->stats, ST_RCV_LOST, lost);
+			}
+
+			win->closed = true;
+			win->floor = win->top;
+		}
 	}
+}
+
+void mgi_phc_update(struct mg *mg)
+{
+	int i;
 
-	return stats;
+	for (i = 0; i < IFINDEX_MAX; i++) {
+		if (mg->interface[i].phc_fd > 0)
+			_mgi_phc_sync(&mg->interface[i]);
+	}
 }
@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <net/ethernet.h>
 
 #include "generator.h"
@@ -19,6 +20,14 @@
  * @return number of successfully initialized interfaces */
 int mgi_init(struct mg *mg, mgi_packet_cb cb);
 
+/** Start TX worker threads, if options.txthreads, and RX threads, if options.rxthreads
+ * @note call after mgt_init() */
+void mgi_start(struct mg *mg);
+
+/** Collect results of frames sent by TX worker threads into interface and line stats
+ * @note call on the main thread, before aggregating stats */
+void mgi_txw_collect(struct mg *mg);
+
 /** Inject frame
  * @param interface  interface to inject frame on
  * @param bssid      BSSID
@@ -35,6 +44,28 @@ int mgi_inject(struct interface *interface,
 	struct ether_addr *bssid, struct ether_addr *dst, struct ether_addr *src, uint8_t rate,
 	uint16_t ether_type, void *data, size_t len);
 
+/** Inject a burst of frames using a single sendmmsg() call
+ * Each frame consists of the common headers, its own head and the common tail.
+ * @param heads      per-frame parts following the LLC header
+ * @param num        number of frames, at most PKT_BURST_MAX
+ * @param tail       data appended to each frame, may be NULL
+ * @param taillen    length of tail
+ * @return           number of frames successfully sent; these are always the first ones
+ * @see mgi_inject() for the rest of the parameters
+ */
+int mgi_inject_burst(struct interface *interface,
+	struct ether_addr *bssid, struct ether_addr *dst, struct ether_addr *src, uint8_t rate,
+	uint16_t ether_type, struct iovec *heads, int num, void *tail, size_t taillen);
+
+/** Version of mgi_inject_burst() accepting already prepared frame headers
+ * @param line       line sending the frames, for line statistics of TX timestamps; may be NULL */
+int mgi_inject_hdrs(struct interface *interface, struct line *line, struct mgi_hdrs *hdrs,
+	struct iovec *heads, int num, void *tail, size_t taillen);
+
+/** Prepare cached frame template of traffic file line
+ * @note call after line->cmd_init(), which may set line->size_max */
+void mgi_line_init(struct line *line);
+
 /** Send mg frame
  * A high-level interface to mgi_inject(). If payload is NULL or not long enough, its constructed
  * from contents of configuration file line.
@@ -46,11 +77,37 @@ int mgi_inject(struct interface *interface,
  *                     that is PKT_TOTAL_OVERHEAD */
 void mgi_sendto(int dstid, struct line *line, uint8_t *payload, int payload_size, int size);
 
+/** Send a burst of num mg frames
+ * Frames are handed to the kernel in batches, using mgi_inject_burst().
+ * @param num          number of frames to send
+ * @return             number of frames successfully sent
+ * @see mgi_sendto() for the rest of the parameters */
+int mgi_sendto_burst(int dstid, struct line *line, uint8_t *payload, int payload_size, int size,
+	int num);
+
+/** Prepare statistics db and stats file writer of given link
+ * Called for links known from the traffic file, so that mgi_linkstats_get() finds them in O(1).
+ * @param interface    interface
+ * @param srcid        source node
+ * @param dstid        destination node
+ */
+void mgi_linkstats_add(struct interface *interface, uint8_t srcid, uint8_t dstid);
+
 /** Get statistics db for given link on given interface
+ * Stats of all links to this node are preallocated in mgi_init(), so this never allocates for them.
+ * Links not prepared by mgi_linkstats_add() get their writer registered later from the event loop.
  * @param interface    interface
  * @param srcid        source node
  * @param dstid        destination node
  */
 stats *mgi_linkstats_get(struct interface *interface, uint8_t srcid, uint8_t dstid);
 
+/** Measure offsets of card clocks used for hardware timestamps again, if options.hwts
+ * Call periodically on the main thread, so that clock drift is followed. */
+void mgi_phc_update(struct mg *mg);
+
+/** Count line counters still missing from receive windows idle for SEQ_IDLE seconds as lost
+ * Later frames with these counters are counted as late. Call periodically on the main thread. */
+void mgi_seq_expire(struct mg *mg);
+
 #endif
@@ -0,0 +1,191 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ */
+
+#include <endian.h>
+#include <libpjf/lib.h>
+#include "lib/radiotap.h"
+
+#include "radio.h"
+#include "generator.h"
+
+/** Radiotap field -> our field number */
+static int _mgr_field(int index)
+{
+	switch (index) {
+		case IEEE80211_RADIOTAP_TSFT:           return MGR_TSFT;
+		case IEEE80211_RADIOTAP_FLAGS:          return MGR_FLAGS;
+		case IEEE80211_RADIOTAP_RATE:           return MGR_RATE;
+		case IEEE80211_RADIOTAP_CHANNEL:        return MGR_CHANNEL;
+		case IEEE80211_RADIOTAP_DBM_ANTSIGNAL:  return MGR_RSSI;
+		case IEEE80211_RADIOTAP_ANTENNA:        return MGR_ANTENNA;
+		default:                                return -1;
+	}
+}
+
+/** Set radio field value
+ * @param arg    pointer to field data */
+static void _mgr_set(struct sniff_pkt *pkt, int field, uint8_t *arg)
+{
+	uint64_t u64;
+	uint16_t u16;
+
+	switch (field) {
+		case MGR_TSFT:
+			memcpy(&u64, arg, sizeof u64);
+			pkt->radio.tsft = le64toh(u64);
+			break;
+
+		case MGR_FLAGS:
+			pkt->radio.flags.val      = *arg;
+			pkt->radio.flags.cfp      = *arg & IEEE80211_RADIOTAP_F_CFP;
+			pkt->radio.flags.shortpre = *arg & IEEE80211_RADIOTAP_F_SHORTPRE;
+			pkt->radio.flags.frag     = *arg & IEEE80211_RADIOTAP_F_FRAG;
+			pkt->radio.flags.badfcs   = *arg & IEEE80211_RADIOTAP_F_BADFCS;
+			break;
+
+		case MGR_RATE:
+			pkt->radio.rate = *arg;
+			break;
+
+		case MGR_CHANNEL:
+			memcpy(&u16, arg, sizeof u16);
+			pkt->radio.freq = le16toh(u16);
+			/* NB: skip channel flags */
+			break;
+
+		case MGR_RSSI:
+			pkt->radio.rssi = *((int8_t *) arg);
+			break;
+
+		case MGR_ANTENNA:
+			pkt->radio.antnum = *arg;
+			break;
+	}
+}
+
+/** Count it_present words of radiotap header */
+static int _mgr_words(struct sniff_pkt *pkt, int len)
+{
+	uint32_t present;
+	int words = 0;
+
+	do {
+		if (8 + words * 4 > len)
+			return -1;
+
+		memcpy(&present, pkt->pkt + 4 + words * 4, sizeof present);
+		words++;
+	} while (le32toh(present) & (1 << IEEE80211_RADIOTAP_EXT));
+
+	return words;
+}
+
+/** Walk radiotap header with the generic iterator, storing last offset of each field
+ * @param off    [out] field offsets, -1 = not present
+ * @retval 0     success */
+static int _mgr_compile(struct sniff_pkt *pkt, int16_t *off)
+{
+	struct ieee80211_radiotap_iterator parser;
+	int n, field;
+
+	for (field = 0; field < MGR_FIELDS; field++)
+		off[field] = -1;
+
+	if (ieee80211_radiotap_iterator_init(&parser, (void *) pkt->pkt, pkt->len) < 0)
+		return -1;
+
+	while ((n = ieee80211_radiotap_iterator_next(&parser)) == 0) {
+		field = _mgr_field(parser.this_arg_index);
+
+		if (field < 0)
+			dbg(3, "unhandled arg %d value %u\n", parser.this_arg_index, *(parser.this_arg));
+		else
+			off[field] = parser.this_arg - pkt->pkt;
+	}
+
+	if (n != -ENOENT) {
+		dbg(1, "ieee80211_radiotap_iterator_next() failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*****/
+
+int mgr_len(struct sniff_pkt *pkt)
+{
+	struct ieee80211_radiotap_header *hdr = (void *) pkt->pkt;
+	int len;
+
+	if (pkt->len < sizeof *hdr || hdr->it_version != 0)
+		return -1;
+
+	len = le16toh(hdr->it_len);
+	if (len < sizeof *hdr || len > pkt->len)
+		return -1;
+
+	return len;
+}
+
+int mgr_decode(struct mgr_cache *cache, struct sniff_pkt *pkt, struct mgr_layout **layout)
+{
+	struct mgr_layout *l;
+	int16_t off[MGR_FIELDS];
+	uint32_t present;
+	int i, len, words;
+
+	len = mgr_len(pkt);
+	if (len < 0)
+		return -1;
+
+	words = _mgr_words(pkt, len);
+	if (words < 0)
+		return -1;
+
+	memcpy(&present, pkt->pkt + 4, sizeof present);
+	present = le32toh(present);
+
+	/* fast path: layout seen before */
+	for (i = 0; i < RADIO_CACHE_SIZE; i++) {
+		l = &cache->layout[i];
+
+		if (l->present == present && l->len == len && l->words == words)
+			goto decode;
+	}
+
+	/* slow path: compile the new layout */
+	if (_mgr_compile(pkt, off) != 0)
+		return -1;
+
+	l = &cache->layout[cache->next];
+	cache->next = (cache->next + 1) % RADIO_CACHE_SIZE;
+
+	l->present = present;
+	l->len = len;
+	l->words = words;
+	memcpy(l->off, off, sizeof off);
+
+	dbg(5, "new radiotap layout: present=0x%08x len=%d words=%d\n", present, len, words);
+
+decode:
+	if (l->off[MGR_TSFT] >= 0)
+		_mgr_set(pkt, MGR_TSFT, pkt->pkt + l->off[MGR_TSFT]);
+	if (l->off[MGR_FLAGS] >= 0)
+		_mgr_set(pkt, MGR_FLAGS, pkt->pkt + l->off[MGR_FLAGS]);
+
+	*layout = l;
+	return 0;
+}
+
+void mgr_decode_rest(struct mgr_layout *layout, struct sniff_pkt *pkt)
+{
+	int field;
+
+	for (field = MGR_RATE; field < MGR_FIELDS; field++) {
+		if (layout->off[field] >= 0)
+			_mgr_set(pkt, field, pkt->pkt + layout->off[field]);
+	}
+}
@@ -0,0 +1,29 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ */
+
+#ifndef _RADIO_H_
+#define _RADIO_H_
+
+#include "generator.h"
+
+/** Check radiotap header of captured frame
+ * @return    radiotap header length
+ * @retval -1 invalid header */
+int mgr_len(struct sniff_pkt *pkt);
+
+/** Decode TSFT and FLAGS fields of captured frame into pkt->radio
+ * Uses field offsets compiled once for each distinct radiotap layout. Unseen layouts are walked by
+ * the generic radiotap iterator and then cached.
+ * @param cache    interface layout cache
+ * @param layout   [out] layout to pass to mgr_decode_rest()
+ * @retval 0       success
+ * @retval -1      invalid radiotap header */
+int mgr_decode(struct mgr_cache *cache, struct sniff_pkt *pkt, struct mgr_layout **layout);
+
+/** Decode the rest of radio fields: RATE, CHANNEL, DBM_ANTSIGNAL and ANTENNA
+ * @param layout   layout returned by mgr_decode() */
+void mgr_decode_rest(struct mgr_layout *layout, struct sniff_pkt *pkt);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ */
+
+/*
+ * Replay engine
+ *
+ * Lines with deterministic timing are expanded into a single array of send events, sorted by time,
+ * which is walked using a single timer. The array covers MGE_CHUNK of experiment time; next chunk
+ * is expanded when the current one is exhausted. Function-valued arguments of lines are resolved
+ * during expansion, in line number order, so that their random values are reproducible.
+ *
+ * A line may push at most MGE_LINE_MAX events per chunk, so that eg. T=0 does not expand all its
+ * repetitions at once; the rest of such a line is sent late, in following chunks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+#include "generator.h"
+#include "interface.h"
+#include "schedule.h"
+#include "clock.h"
+#include "stats.h"
+
+static int _mge_cmp(const void *a, const void *b)
+{
+	const struct mge_event *e1 = a, *e2 = b;
+
+	if (e1->time != e2->time)
+		return e1->time < e2->time ? -1 : 1;
+	else
+		return (int) e1->line->line_num - (int) e2->line->line_num;
+}
+
+/** Expand next chunk of timeline
+ * @retval false     no events left */
+static bool _mge_expand(struct mge *e)
+{
+	int i, j;
+
+	e->num = 0;
+	e->cur = 0;
+
+	/* skip chunks with no events, eg. before late-starting lines */
+	while (e->num == 0 && e->lines_num > 0) {
+		e->horizon += MGE_CHUNK;
+
+		for (i = j = 0; i < e->lines_num; i++) {
+			e->line_first = e->num;
+			if (e->lines[i]->cmd_expand(e->lines[i], e->horizon))
+				e->lines[j++] = e->lines[i];
+		}
+		e->lines_num = j;
+	}
+
+	/* lines push their events in time order, but interleave */
+	qsort(e->ev, e->num, sizeof *e->ev, _mge_cmp);
+
+	dbg(5, "replay: expanded %d events until %llu us\n", e->num, (unsigned long long) e->horizon);
+	return e->num > 0;
+}
+
+/** Send frame burst of event */
+static void _mge_send(struct mge *e, struct mge_event *ev)
+{
+	struct line *line = ev->line;
+	uint64_t us;
+
+	if (e->mg->options.txtime > 0) {
+		us = (uint64_t) e->mg->origin.tv_sec * 1000000 + e->mg->origin.tv_usec + ev->time;
+		line->schedule.launch.tv_sec  = us / 1000000;
+		line->schedule.launch.tv_usec = us % 1000000;
+	}
+
+	/* account the line as if its own timer fired */
+	stats_icount(line->stats, ST_SCHEDULER_EVT);
+	mgs_late(e->mg, line->stats,
+		(uint64_t) e->mg->origin.tv_sec * 1000000 + e->mg->origin.tv_usec + ev->time);
+
+	mgi_sendto_burst(0, line, NULL, 0, ev->len, ev->burst);
+	timerclear(&line->schedule.launch);
+
+	if (ev->last)
+		e->mg->running--;
+}
+
+/** Schedule timer to next event */
+static void _mge_schedule(struct mge *e)
+{
+	struct timeval tv;
+	uint64_t next, now;
+
+	/* next event already due: its line lags, as mgs_schedule() would count for its own timer */
+	next = e->ev[e->cur].time;
+	now = mgt_now(e->mg) - ((uint64_t) e->mg->origin.tv_sec * 1000000 + e->mg->origin.tv_usec);
+	if (next < now)
+		stats_icount(e->ev[e->cur].line->stats, ST_SCHEDULER_LAG);
+
+	if (next < e->at)
+		next = e->at;
+
+	tv.tv_sec  = (next - e->at) / 1000000;
+	tv.tv_usec = (next - e->at) % 1000000;
+	mgs_schedule(&e->sch, &tv);
+
+	e->at = next;
+}
+
+/** Timer handler: dispatch events due */
+static void _mge_run(int fd, short evtype, void *arg)
+{
+	struct mge *e = arg;
+	struct mge_event *ev;
+	struct timeval now;
+	int64_t t;
+	uint64_t until;
+	int n;
+
+	/* dispatch events up to target time or now, whichever is later */
+	mgt_now_tv(e->mg, &now);
+	t = ((int64_t) now.tv_sec - e->mg->origin.tv_sec) * 1000000 + (now.tv_usec - e->mg->origin.tv_usec);
+	until = t > (int64_t) e->at ? (uint64_t) t : e->at;
+
+	for (n = 0; n < MGE_BATCH_MAX; n++) {
+		if (e->cur == e->num && !_mge_expand(e))
+			return;
+
+		ev = &e->ev[e->cur];
+		if (ev->time > until)
+			break;
+
+		e->cur++;
+		_mge_send(e, ev);
+	}
+
+	if (e->cur == e->num && !_mge_expand(e))
+		return;
+
+	_mge_schedule(e);
+}
+
+bool mge_add(struct mg *mg, struct line *line)
+{
+	struct mge *e;
+
+	if (!line->cmd_expand)
+		return false;
+
+	if (!mg->replay) {
+		e = mg->replay = mmatic_zalloc(mg->mm, sizeof *e);
+		e->mg = mg;
+
+		/* no sch.stats: lateness is counted for each event, in stats of its line */
+		mgs_setup(&e->sch, mg, _mge_run, e);
+	}
+
+	mg->replay->lines[mg->replay->lines_num++] = line;
+	return true;
+}
+
+bool mge_push(struct line *line, uint64_t time, uint32_t len, uint32_t burst, bool last)
+{
+	struct mge *e = line->mg->replay;
+	struct mge_event *ev;
+	int size;
+
+	if (e->num == e->size) {
+		size = e->size ? e->size * 2 : 1024;
+		ev = mmatic_alloc(e->mg->mm, size * sizeof *ev);
+
+		if (e->ev) {
+			memcpy(ev, e->ev, e->num * sizeof *ev);
+			mmatic_free(e->ev);
+		}
+
+		e->ev = ev;
+		e->size = size;
+	}
+
+	ev = &e->ev[e->num++];
+	ev->time  = time;
+	ev->line  = line;
+	ev->len   = len;
+	ev->burst = burst;
+	ev->last  = last;
+
+	return e->num - e->line_first < MGE_LINE_MAX;
+}
+
+void mge_start(struct mg *mg)
+{
+	struct mge *e = mg->replay;
+
+	if (!e)
+		return;
+
+	dbg(1, "replaying %d lines from timeline\n", e->lines_num);
+
+	if (_mge_expand(e))
+		_mge_schedule(e);
+}
@@ -0,0 +1,28 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include "generator.h"
+
+/** Take traffic line over to the replay timeline
+ * @retval true      line will be sent by the replay engine
+ * @retval false     line can not be replayed, schedule it as usual */
+bool mge_add(struct mg *mg, struct line *line);
+
+/** Add frame burst to the replay timeline, for cmd_*_expand() handlers
+ * @param time       send time [us since origin]
+ * @param len        frame size
+ * @param burst      number of frames
+ * @param last       true if this is the last burst of line
+ * @retval false     line has MGE_LINE_MAX events in this chunk: stop, continue in the next one */
+bool mge_push(struct line *line, uint64_t time, uint32_t len, uint32_t burst, bool last);
+
+/** Expand first chunk of the replay timeline and schedule it
+ * @note does nothing if no line was added using mge_add() */
+void mge_start(struct mg *mg);
+
+#endif
@@ -3,15 +3,335 @@
  * IITiS PAN Gliwice
  */
 
+#define _GNU_SOURCE
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+
 #include "schedule.h"
 #include "generator.h"
+#include "clock.h"
 #include "stats.h"
 
+/** Get time in [us] */
+static inline uint64_t _mgs_us(const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static inline uint64_t _mgs_rotl(uint64_t v, int c)
+{
+	c &= 63;
+	return c ? (v << c) | (v >> (64 - c)) : v;
+}
+
+static inline uint64_t _mgs_rotr(uint64_t v, int c)
+{
+	c &= 63;
+	return c ? (v >> c) | (v << (64 - c)) : v;
+}
+
+/*
+ * Hierarchical timer wheel
+ *
+ * Level L has MGS_WHEEL_LEN slots, each covering 2^(L * MGS_WHEEL_BITS) us. A timer goes to the
+ * level given by the time left until its expiry, and the slot given by its expiry time. While wheel
+ * time advances, timers in slots passed by are put on the wheel again, dropping to lower levels
+ * until they expire. Non-empty slots are tracked in bitmaps, so both finding the next expiry and
+ * advancing the wheel by any amount of time take a few word operations per level.
+ */
+
+/** Take schedule off the wheel */
+static void _mgs_wheel_del(struct mgs_wheel *w, struct schedule *sch)
+{
+	int i;
+
+	if (!sch->wlist)
+		return;
+
+	TAILQ_REMOVE(sch->wlist, sch, wentry);
+
+	if (TAILQ_EMPTY(sch->wlist) && sch->wlist >= &w->slot[0][0] &&
+	    sch->wlist <= &w->slot[MGS_WHEEL_NUM - 1][MGS_WHEEL_LEN - 1]) {
+		i = sch->wlist - &w->slot[0][0];
+		w->pending[i / MGS_WHEEL_LEN] &= ~(UINT64_C(1) << (i % MGS_WHEEL_LEN));
+	}
+
+	sch->wlist = NULL;
+}
+
+/** Put schedule on the wheel according to sch->expire */
+static void _mgs_wheel_put(struct mgs_wheel *w, struct schedule *sch)
+{
+	uint64_t left;
+	int level, slot;
+
+	if (sch->expire <= w->now) {
+		sch->wlist = &w->expired;
+	} else {
+		left  = MIN(sch->expire - w->now, MGS_WHEEL_MAX);
+		level = (63 - __builtin_clzll(left)) / MGS_WHEEL_BITS;
+
+		/* on upper levels, take the timer out one slot earlier, so it can drop down in time */
+		slot  = ((sch->expire >> (level * MGS_WHEEL_BITS)) - !!level) & (MGS_WHEEL_LEN - 1);
+
+		sch->wlist = &w->slot[level][slot];
+		w->pending[level] |= UINT64_C(1) << slot;
+	}
+
+	TAILQ_INSERT_TAIL(sch->wlist, sch, wentry);
+}
+
+/** Advance wheel time, moving due timers to w->expired */
+static void _mgs_wheel_update(struct mgs_wheel *w, uint64_t now)
+{
+	struct mgs_list todo;
+	struct schedule *sch;
+	uint64_t elapsed, passed, mask;
+	int level, oslot, nslot, slot, n;
+
+	if (now <= w->now)
+		return;
+
+	elapsed = now - w->now;
+	TAILQ_INIT(&todo);
+
+	for (level = 0; level < MGS_WHEEL_NUM; level++) {
+		/* bitmap of slots passed on this level */
+		if ((elapsed >> (level * MGS_WHEEL_BITS)) >= MGS_WHEEL_LEN) {
+			passed = ~UINT64_C(0);
+		} else {
+			n     = (elapsed >> (level * MGS_WHEEL_BITS)) & (MGS_WHEEL_LEN - 1);
+			mask  = (UINT64_C(1) << n) - 1;
+			oslot = (w->now >> (level * MGS_WHEEL_BITS)) & (MGS_WHEEL_LEN - 1);
+			nslot = (now >> (level * MGS_WHEEL_BITS)) & (MGS_WHEEL_LEN - 1);
+
+			passed  = _mgs_rotl(mask, oslot);
+			passed |= _mgs_rotr(_mgs_rotl(mask, nslot), n);
+			passed |= UINT64_C(1) << nslot;
+		}
+
+		while (passed & w->pending[level]) {
+			slot = __builtin_ctzll(passed & w->pending[level]);
+			TAILQ_CONCAT(&todo, &w->slot[level][slot], wentry);
+			w->pending[level] &= ~(UINT64_C(1) << slot);
+		}
+
+		/* upper level moves only if this one wrapped around */
+		if (!(passed & 1))
+			break;
+
+		elapsed = MAX(elapsed, (uint64_t) MGS_WHEEL_LEN << (level * MGS_WHEEL_BITS));
+	}
+
+	w->now = now;
+
+	while ((sch = TAILQ_FIRST(&todo))) {
+		TAILQ_REMOVE(&todo, sch, wentry);
+		_mgs_wheel_put(w, sch);
+	}
+}
+
+/** Get time from wheel time until the wheel needs to be advanced [us]
+ * @retval UINT64_MAX   wheel is empty */
+static uint64_t _mgs_wheel_next(struct mgs_wheel *w)
+{
+	uint64_t t, next = UINT64_MAX, lower = 0;
+	int level, slot;
+
+	if (!TAILQ_EMPTY(&w->expired))
+		return 0;
+
+	for (level = 0; level < MGS_WHEEL_NUM; level++) {
+		if (w->pending[level]) {
+			slot = (w->now >> (level * MGS_WHEEL_BITS)) & (MGS_WHEEL_LEN - 1);
+
+			/* upper level slots are one rotation ahead, minus progress of lower levels */
+			t  = (uint64_t) (__builtin_ctzll(_mgs_rotr(w->pending[level], slot)) + !!level)
+				<< (level * MGS_WHEEL_BITS);
+			t -= lower & w->now;
+
+			next = MIN(next, t);
+		}
+
+		lower = (lower << MGS_WHEEL_BITS) | (MGS_WHEEL_LEN - 1);
+	}
+
+	return next;
+}
+
+/** Set the libevent timer to the next wheel event */
+static void _mgs_wheel_arm(struct mgs_wheel *w)
+{
+	struct timeval tv;
+	uint64_t next, nowus;
+
+	next = _mgs_wheel_next(w);
+	if (next == UINT64_MAX)
+		return;
+
+	next += w->now;
+	if (w->armed && w->armed <= next)
+		return;
+
+	nowus = mgt_now(w->mg);
+	next = MAX(next, nowus);
+
+	tv.tv_sec  = (next - nowus) / 1000000;
+	tv.tv_usec = (next - nowus) % 1000000;
+	evtimer_add(&w->ev, &tv);
+
+	w->armed = next;
+}
+
+/** Wait until sch->last (minus txtime lead): sleep on CLOCK_MONOTONIC, spin the last SCHED_SPIN us
+ * Timer wakeup jitter is absorbed by options.precision. Adds achieved minus intended time to
+ * scheduler_error [us], like the other time stats. */
+static void _mgs_precise(struct schedule *sch)
+{
+	struct timespec deadline, ts;
+	int64_t target, left;
+
+	target = (int64_t) _mgs_us(&sch->last) - MAX(sch->mg->options.txtime, 0);
+	left = target - (int64_t) mgt_now(sch->mg);
+
+	/* already late? */
+	if (left <= 0) {
+		stats_ihist(sch->mg->stats, ST_SCHEDULER_ERROR, MIN(-left, UINT32_MAX));
+		return;
+	}
+
+	/* generator time is CLOCK_MONOTONIC shifted by a constant */
+	target -= sch->mg->mono_offset;
+	deadline.tv_sec  = target / 1000000;
+	deadline.tv_nsec = (target % 1000000) * 1000;
+
+	if (left > SCHED_SPIN) {
+		ts = deadline;
+		ts.tv_nsec -= SCHED_SPIN * 1000;
+		if (ts.tv_nsec < 0) {
+			ts.tv_sec--;
+			ts.tv_nsec += 1000000000;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+	}
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+	} while (ts.tv_sec < deadline.tv_sec ||
+	         (ts.tv_sec == deadline.tv_sec && ts.tv_nsec < deadline.tv_nsec));
+
+	/* rounded to nearest us */
+	stats_ihist(sch->mg->stats, ST_SCHEDULER_ERROR, MIN(
+		(ts.tv_sec - deadline.tv_sec) * 1000000LL + (ts.tv_nsec - deadline.tv_nsec + 500) / 1000,
+		UINT32_MAX));
+}
+
+void mgs_late(struct mg *mg, stats *stats, uint64_t wanted)
+{
+	int64_t late;
+
+	late = (int64_t) mgt_now(mg) - ((int64_t) wanted - MAX(mg->options.txtime, 0));
+	late = MIN(MAX(late, 0), UINT32_MAX);
+
+	stats_ihist(stats, ST_SCHEDULER_LATE, late);
+	stats_ihist(mg->stats, ST_SCHEDULER_LATE, late);
+
+	if (late > mg->options.late_threshold) {
+		stats_icountN(stats, ST_SCHEDULER_DEBT, late);
+		stats_icountN(mg->stats, ST_SCHEDULER_DEBT, late);
+	}
+}
+
+/** Timer handler: run callback, letting it know its target time */
+static void _mgs_fire(int fd, short evtype, void *arg)
+{
+	struct schedule *sch = arg;
+
+	if (sch->mg->options.precision > 0)
+		_mgs_precise(sch);
+
+	if (sch->stats)
+		mgs_late(sch->mg, sch->stats, _mgs_us(&sch->last));
+
+	if (sch->mg->options.txtime > 0)
+		sch->launch = sch->last;
+
+	sch->cb(fd, evtype, sch->arg);
+	timerclear(&sch->launch);
+}
+
+/** Wheel timer handler: advance the wheel and run due callbacks */
+static void _mgs_wheel_run(int fd, short evtype, void *arg)
+{
+	struct mgs_wheel *w = arg;
+	struct mgs_list due;
+	struct schedule *sch;
+
+	w->armed = 0;
+	_mgs_wheel_update(w, mgt_now(w->mg));
+
+	/* callbacks rescheduling into the past will run on next wakeup, letting other events in */
+	TAILQ_INIT(&due);
+	TAILQ_CONCAT(&due, &w->expired, wentry);
+	TAILQ_FOREACH(sch, &due, wentry)
+		sch->wlist = &due;
+
+	w->running = true;
+	while ((sch = TAILQ_FIRST(&due))) {
+		TAILQ_REMOVE(&due, sch, wentry);
+		sch->wlist = NULL;
+		_mgs_fire(-1, EV_TIMEOUT, sch);
+	}
+	w->running = false;
+
+	_mgs_wheel_arm(w);
+}
+
+/** Schedule on the timer wheel
+ * @param expire    absolute time [us] */
+static void _mgs_wheel_add(struct mgs_wheel *w, struct schedule *sch, uint64_t expire)
+{
+	_mgs_wheel_del(w, sch);
+	sch->expire = expire;
+	_mgs_wheel_put(w, sch);
+
+	if (!w->running && (!w->armed || expire < w->armed))
+		_mgs_wheel_arm(w);
+}
+
+/** Create timer wheel */
+static struct mgs_wheel *_mgs_wheel_create(struct mg *mg)
+{
+	struct mgs_wheel *w;
+	int i, j;
+
+	w = mmatic_zalloc(mg->mm, sizeof *w);
+	w->mg = mg;
+	w->now = mgt_now(mg);
+
+	for (i = 0; i < MGS_WHEEL_NUM; i++) {
+		for (j = 0; j < MGS_WHEEL_LEN; j++)
+			TAILQ_INIT(&w->slot[i][j]);
+	}
+	TAILQ_INIT(&w->expired);
+
+	evtimer_set(&w->ev, _mgs_wheel_run, w);
+	dbg(1, "using timer wheel scheduler\n");
+
+	return w;
+}
+
 void mgs_schedule(struct schedule *sch, struct timeval *timeout)
 {
 	struct timeval now, wanted, tv;
+	int lead;
 
-	stats_count(sch->mg->stats, "scheduler_evt");
+	stats_icount(sch->mg->stats, ST_SCHEDULER_EVT);
+	if (sch->stats)
+		stats_icount(sch->stats, ST_SCHEDULER_EVT);
 
 	/* first "last run" is at the origin */
 	if (sch->last.tv_sec == 0) {
@@ -23,17 +343,36 @@ void mgs_schedule(struct schedule *sch, struct timeval *timeout)
 	timeradd(&sch->last, timeout, &wanted);
 
 	/* how it looks compared to time now? */
-	gettimeofday(&now, NULL);
+	mgt_now_tv(sch->mg, &now);
 
 	if (timercmp(&now, &wanted, >)) {
 		timerclear(&tv);
-		stats_count(sch->mg->stats, "scheduler_lag");
+		stats_icount(sch->mg->stats, ST_SCHEDULER_LAG);
+		if (sch->stats)
+			stats_icount(sch->stats, ST_SCHEDULER_LAG);
 	} else {
 		timersub(&wanted, &now, &tv);
+
+		/* fire early: frames will be released on time by the kernel, or we will wait in _mgs_precise() */
+		lead = MAX(sch->mg->options.txtime, 0) + MAX(sch->mg->options.precision, 0);
+		if (lead > 0) {
+			if (tv.tv_sec == 0 && tv.tv_usec <= lead) {
+				timerclear(&tv);
+			} else {
+				tv.tv_usec -= lead;
+				while (tv.tv_usec < 0) {
+					tv.tv_sec--;
+					tv.tv_usec += 1000000;
+				}
+			}
+		}
 	}
 
 	/* schedule */
-	evtimer_add(&sch->ev, &tv);
+	if (sch->mg->wheel)
+		_mgs_wheel_add(sch->mg->wheel, sch, _mgs_us(&now) + _mgs_us(&tv));
+	else
+		evtimer_add(&sch->ev, &tv);
 
 	/* store last schedule */
 	sch->last.tv_sec  = wanted.tv_sec;
@@ -64,5 +403,27 @@ void mgs_setup(struct schedule *sch, struct mg *mg, void (*cb)(int, short, void
 	sch->mg = mg;
 	sch->cb = cb;
 	sch->arg = arg;
-	evtimer_set(&sch->ev, cb, arg);
+	evtimer_set(&sch->ev, _mgs_fire, sch);
+}
+
+int mgs_init(struct mg *mg)
+{
+	cpu_set_t cpus;
+
+	if (mg->options.cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(mg->options.cpu, &cpus);
+
+		if (sched_setaffinity(0, sizeof cpus, &cpus) != 0) {
+			dbg(0, "could not pin to CPU %d: %s\n", mg->options.cpu, strerror(errno));
+			return 1;
+		}
+
+		dbg(1, "pinned to CPU %d\n", mg->options.cpu);
+	}
+
+	if (streq(mg->options.scheduler, "wheel"))
+		mg->wheel = _mgs_wheel_create(mg);
+
+	return 0;
 }
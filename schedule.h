@@ -26,6 +26,17 @@ void mgs_sleep(struct line *line, struct timeval *tv);
 /** Version of mgs_sleep() accepting microseconds */
 void mgs_usleep(struct line *line, uint32_t time_us);
 
+/** Count how late an event is dispatched, compared with its wanted time
+ * Done for callbacks of schedules with stats; adds to scheduler_late and scheduler_debt.
+ * @param stats      stats db of the event, eg. line->stats; mg->stats is updated too
+ * @param wanted     wanted time, before options.txtime lead [us of generator time] */
+void mgs_late(struct mg *mg, stats *stats, uint64_t wanted);
+
+/** Initialize scheduler
+ * @retval 0         success
+ * @retval 1         could not pin to options.cpu */
+int mgs_init(struct mg *mg);
+
 /** Setup a struct schedule
  * @param cb         libevent handler
  * @param arg        argument to callback (passed as 3rd arg) */
@@ -6,30 +6,272 @@
 #include <time.h>
 #include <stdarg.h>
 #include <sys/stat.h>
+#include <ctype.h>
+#include <sched.h>
+#include <endian.h>
 
 #include "generator.h"
 #include "stats.h"
+#include "clock.h"
 #include "schedule.h"
+#include "interface.h"
+#include "statslog.h"
+
+/** Names of statistics indexed by id; first ST_STATIC ones match enum stats_id */
+static const char *stats_names[STATS_MAX] = {
+	[ST_SCHEDULER_EVT]     = "scheduler_evt",
+	[ST_SCHEDULER_LAG]     = "scheduler_lag",
+	[ST_SCHEDULER_ERROR]   = "scheduler_error",
+	[ST_SCHEDULER_LATE]    = "scheduler_late",
+	[ST_SCHEDULER_DEBT]    = "scheduler_debt",
+	[ST_STATS_FLUSH]       = "stats_flush",
+	[ST_STATS_OVERRUN]     = "stats_overrun",
+
+	[ST_SNT_OK]            = "snt_ok",
+	[ST_SNT_OK_BYTES]      = "snt_ok_bytes",
+	[ST_SNT_ERR]           = "snt_err",
+	[ST_SNT_TIME]          = "snt_time",
+	[ST_SNT_RING_FULL]     = "snt_ring_full",
+	[ST_SNT_KICK_ERR]      = "snt_kick_err",
+	[ST_SNT_QUEUE_FULL]    = "snt_queue_full",
+	[ST_SNT_SCHED]         = "snt_sched",
+	[ST_SNT_QDELAY]        = "snt_qdelay",
+	[ST_SNT_TXTIME_LATE]   = "snt_txtime_late",
+	[ST_SNT_TXTIME_DROP]   = "snt_txtime_drop",
+	[ST_SNT_TXTS_MISS]     = "snt_txts_miss",
+
+	[ST_RCV_ALL]           = "rcv_all",
+	[ST_RCV_ALL_BYTES]     = "rcv_all_bytes",
+	[ST_RCV_CFP]           = "rcv_cfp",
+	[ST_RCV_SHORTPRE]      = "rcv_shortpre",
+	[ST_RCV_FRAG]          = "rcv_frag",
+	[ST_RCV_BADFCS]        = "rcv_badfcs",
+	[ST_RCV_BEACONS]       = "rcv_beacons",
+	[ST_RCV_ACK]           = "rcv_ack",
+	[ST_RCV_NONDATA]       = "rcv_nondata",
+	[ST_RCV_RETRY]         = "rcv_retry",
+	[ST_RCV_WRONG_BSSID]   = "rcv_wrong_bssid",
+	[ST_RCV_WRONG_CHANNEL] = "rcv_wrong_channel",
+	[ST_RCV_WRONG_DST]     = "rcv_wrong_dst",
+	[ST_RCV_ALIENS]        = "rcv_aliens",
+	[ST_RCV_OK]            = "rcv_ok",
+	[ST_RCV_OK_BYTES]      = "rcv_ok_bytes",
+	[ST_RCV_DUP]           = "rcv_dup",
+	[ST_RCV_DUP_BYTES]     = "rcv_dup_bytes",
+	[ST_RCV_LOST]          = "rcv_lost",
+	[ST_RCV_DELAY]         = "rcv_delay",
+	[ST_RCV_DELAY_NEG]     = "rcv_delay_neg",
+	[ST_RCV_REORDER]       = "rcv_reorder",
+	[ST_RCV_LATE]          = "rcv_late",
+	[ST_RCV_QUEUE_FULL]    = "rcv_queue_full",
+
+	[ST_RCV_BATCH_1 + 0]   = "rcv_batch_1",
+	[ST_RCV_BATCH_1 + 1]   = "rcv_batch_2",
+	[ST_RCV_BATCH_1 + 2]   = "rcv_batch_4",
+	[ST_RCV_BATCH_1 + 3]   = "rcv_batch_8",
+	[ST_RCV_BATCH_1 + 4]   = "rcv_batch_16",
+	[ST_RCV_BATCH_1 + 5]   = "rcv_batch_32",
+	[ST_RCV_BATCH_1 + 6]   = "rcv_batch_64",
+	[ST_RCV_BATCH_1 + 7]   = "rcv_batch_128",
+
+	[ST_RSSI]              = "rssi",
+	[ST_RATE]              = "rate",
+	[ST_ANTNUM]            = "antnum",
+};
+
+/** Number of registered statistics names */
+static int stats_num = ST_STATIC;
+
+/** Statistics name -> id + 1 */
+static thash *stats_ids;
+static mmatic *stats_mm;
+
+/** Get id of registered statistics name
+ * @retval -1    name not registered */
+static int _stats_lookup(const char *name)
+{
+	void *val;
+	int i;
+
+	if (!stats_ids) {
+		stats_mm = mmatic_create();
+		stats_ids = thash_create_strkey(NULL, stats_mm);
+		for (i = 0; i < stats_num; i++)
+			thash_set(stats_ids, stats_names[i], (void *) (long) (i + 1));
+	}
+
+	val = thash_get(stats_ids, name);
+	return val ? (long) val - 1 : -1;
+}
+
+/** Resolve statistics file column name, possibly with histogram suffix */
+static void _stats_column(const char *name, struct stats_column *col)
+{
+	const char *suffix;
+	char *end, base[128];
+	double pct;
+
+	memset(col, 0, sizeof *col);
+
+	suffix = strrchr(name, '_');
+	if (!suffix || _stats_lookup(name) >= 0)
+		goto plain;
+
+	suffix++;
+	if (streq(suffix, "min")) {
+		col->what = STATS_COL_MIN;
+	} else if (streq(suffix, "max")) {
+		col->what = STATS_COL_MAX;
+	} else if (streq(suffix, "avg")) {
+		col->what = STATS_COL_AVG;
+	} else if (streq(suffix, "count")) {
+		col->what = STATS_COL_COUNT;
+	} else if (suffix[0] == 'p' && isdigit(suffix[1])) {
+		pct = strtod(suffix + 1, &end);
+		if (*end || pct > 100.0)
+			goto plain;
+
+		col->what = STATS_COL_PCT;
+		col->pct = pct * 100.0 + 0.5;
+	} else {
+		goto plain;
+	}
+
+	snprintf(base, sizeof base, "%.*s", (int) (suffix - name - 1), name);
+	col->id = stats_id(base);
+	return;
+
+plain:
+	col->what = STATS_COL_VALUE;
+	col->id = stats_id(name);
+}
+
+/** Highest value falling into histogram bucket */
+static uint32_t _stats_hist_high(int b)
+{
+	int e;
+	uint32_t low;
+
+	if (b < (1 << STATS_HIST_SUB_BITS))
+		return b;
+
+	e = (b >> STATS_HIST_SUB_BITS) + STATS_HIST_SUB_BITS - 1;
+	low = ((uint32_t) (1 << STATS_HIST_SUB_BITS) + (b & ((1 << STATS_HIST_SUB_BITS) - 1)))
+		<< (e - STATS_HIST_SUB_BITS);
+
+	return low + ((uint32_t) 1 << (e - STATS_HIST_SUB_BITS)) - 1;
+}
+
+/** Get histogram percentile
+ * @param pct    percentile x 100 */
+static uint32_t _stats_hist_pct(struct stats_hist *h, int pct)
+{
+	uint64_t target, sum = 0;
+	int b;
+
+	target = ((uint64_t) h->count * pct + 9999) / 10000;
+	if (target == 0)
+		target = 1;
+
+	for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+		sum += h->bucket[b];
+		if (sum >= target)
+			return MIN(_stats_hist_high(b), h->max);
+	}
+
+	return h->max;
+}
+
+/** Get histogram column value */
+static uint64_t _stats_hist_value(struct stats_hist *h, struct stats_column *col)
+{
+	if (h->count == 0)
+		return 0;
+
+	switch (col->what) {
+		case STATS_COL_VALUE: return h->sum;
+		case STATS_COL_PCT:   return _stats_hist_pct(h, col->pct);
+		case STATS_COL_MIN:   return h->min;
+		case STATS_COL_MAX:   return h->max;
+		case STATS_COL_AVG:   return (h->sum + h->count / 2) / h->count;
+		case STATS_COL_COUNT: return h->count;
+	}
 
-static void _stats_writer_free(void *arg)
+	return 0;
+}
+
+/** Get value of statistics file column
+ * @retval false   unknown node type */
+static bool _stats_value(struct stats_node *n, struct stats_column *col, int64_t *val)
 {
-	struct stats_writer *sa = arg;
+	switch (n->type) {
+		case STATS_NONE:
+			*val = 0;
+			return true;
+		case STATS_COUNTER:
+			*val = n->as.counter;
+			return true;
+		case STATS_GAUGE:
+			if (n->as.gauge % 100 >= 50)
+				*val = n->as.gauge / 100 + 1;
+			else
+				*val = n->as.gauge / 100;
+			return true;
+		case STATS_HISTOGRAM:
+			*val = _stats_hist_value(n->as.hist, col);
+			return true;
+		default:
+			*val = 0;
+			return false;
+	}
+}
+
+/** Add src histogram to dst */
+static void _stats_hist_merge(struct stats_hist *dst, struct stats_hist *src)
+{
+	int b;
+
+	if (src->count == 0)
+		return;
+
+	if (dst->count == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
 
-	tlist_free(sa->columns);
-	mmatic_free(sa->filename);
-	mmatic_free(sa->dirname);
-	mmatic_free(sa);
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (b = 0; b < STATS_HIST_BUCKETS; b++)
+		dst->bucket[b] += src->bucket[b];
 }
 
-/** Append statistics line to file */
-static void _stats_write(struct mg *mg, struct stats_writer *sa, stats *stats)
+/** Bring stats db back to its state after stats_create(), keeping memory of histograms */
+static void _stats_reset(stats *stats)
+{
+	struct stats_node *n;
+	int i;
+
+	for (i = 0; i < stats_num; i++) {
+		n = &stats->node[i];
+		if (n->type == STATS_HISTOGRAM) {
+			memset(n->as.hist, 0, sizeof *n->as.hist);
+		} else {
+			n->type = STATS_NONE;
+			memset(&n->as, 0, sizeof n->as);
+		}
+	}
+}
+
+/** Append statistics line to file
+ * @param now    generator time of stats */
+static void _stats_write(struct mg *mg, struct stats_writer *sa, stats *stats, struct timeval *now)
 {
 	const char *key;
-	struct timeval now;
 	char buf[256];
 	struct stats_node *n;
-
-	gettimeofday(&now, NULL);
+	struct stats_column *col;
+	int64_t val;
+	int i;
 
 	/* create file if needed */
 	if (!sa->fh) {
@@ -57,31 +299,23 @@ static void _stats_write(struct mg *mg, struct stats_writer *sa, stats *stats)
 	}
 
 	/* 1. put time column */
-	snprintf(buf, sizeof buf, "%lu", (unsigned int) now.tv_sec - mg->origin.tv_sec);
+	snprintf(buf, sizeof buf, "%lu", (unsigned int) now->tv_sec - mg->origin.tv_sec);
 	fputs(buf, sa->fh);
 
 	/* 2+ put requested columns */
+	i = 0;
 	tlist_iter_loop(sa->columns, key) {
-		n = thash_get(stats->db, key);
-		if (!n) {
+		col = &sa->cols[i++];
+		n = &stats->node[col->id];
+
+		if (n->type == STATS_NONE)
 			dbg(10, "no such stats: %s\n", key);
-			snprintf(buf, sizeof buf, " 0");
+
+		if (_stats_value(n, col, &val)) {
+			snprintf(buf, sizeof buf, " %lld", (long long) val);
 		} else {
-			switch (n->type) {
-				case STATS_COUNTER:
-					snprintf(buf, sizeof buf, " %u", n->as.counter);
-					break;
-				case STATS_GAUGE:
-					if (n->as.gauge % 100 >= 50)
-						snprintf(buf, sizeof buf, " %d", n->as.gauge / 100 + 1);
-					else
-						snprintf(buf, sizeof buf, " %d", n->as.gauge / 100);
-					break;
-				default:
-					dbg(1, "unknown type %d of stat: %s\n", n->type, key);
-					snprintf(buf, sizeof buf, " ?");
-					break;
-			}
+			dbg(1, "unknown type %d of stat: %s\n", n->type, key);
+			snprintf(buf, sizeof buf, " ?");
 		}
 
 		fputs(buf, sa->fh);
@@ -91,36 +325,231 @@ static void _stats_write(struct mg *mg, struct stats_writer *sa, stats *stats)
 	fflush(sa->fh);
 }
 
-/** Iterate through mg->stats_writers calling handlers and writing results to files */
+/** Append binary log record */
+static void _stats_log_record(struct mg *mg, uint32_t type, uint32_t writer, const void *data, uint32_t len)
+{
+	struct mgsl_hdr hdr;
+
+	hdr.type   = htole32(type);
+	hdr.writer = htole32(writer);
+	hdr.len    = htole32(len);
+
+	if (fwrite(&hdr, sizeof hdr, 1, mg->stats_async.log) != 1 ||
+	    (len && fwrite(data, len, 1, mg->stats_async.log) != 1))
+		die("writing %s/%s failed\n", mg->stats_dir, MGSL_FILENAME);
+}
+
+/** Append statistics row to binary log, instead of a file of its own
+ * @param now    generator time of stats */
+static void _stats_log_write(struct mg *mg, struct stats_writer *sa, stats *stats, struct timeval *now)
+{
+	struct mgstats_async *a = &mg->stats_async;
+	const char *key;
+	char buf[256];
+	int num = tlist_count(sa->columns);
+	uint8_t row[sizeof(uint32_t) + num * sizeof(int64_t)];
+	uint8_t *rec, *p;
+	uint32_t len, u32;
+	int64_t val;
+	int i;
+
+	/* create file if needed */
+	if (!a->log) {
+		snprintf(buf, sizeof buf, "%s/%s", mg->stats_dir, MGSL_FILENAME);
+		a->log = fopen(buf, "w");
+		if (!a->log)
+			die("fopen(%s) failed\n", buf);
+
+		if (mg->options.world)
+			chmod(buf, 0666);
+
+		/* rows of all writers go through one buffer, flushed once per stats write */
+		setvbuf(a->log, NULL, _IOFBF, STATSLOG_BUFSIZE);
+
+		u32 = htole32(MGSL_VERSION);
+		fwrite(MGSL_MAGIC, 4, 1, a->log);
+		fwrite(&u32, sizeof u32, 1, a->log);
+	}
+
+	/* describe writer on its first row */
+	if (!sa->logged) {
+		len = sizeof u32 + strlen(sa->dirname) + 1 + strlen(sa->filename) + 1;
+		tlist_iter_loop(sa->columns, key)
+			len += strlen(key) + 1;
+
+		/* not from mg->mm, which belongs to the main thread */
+		rec = p = malloc(len);
+		if (!rec)
+			die("malloc() failed\n");
+
+		u32 = htole32(num);
+		memcpy(p, &u32, sizeof u32);
+		p += sizeof u32;
+
+		p = (uint8_t *) stpcpy((char *) p, sa->dirname) + 1;
+		p = (uint8_t *) stpcpy((char *) p, sa->filename) + 1;
+		tlist_iter_loop(sa->columns, key)
+			p = (uint8_t *) stpcpy((char *) p, key) + 1;
+
+		sa->logid = a->log_writers++;
+		sa->logged = true;
+		_stats_log_record(mg, MGSL_SCHEMA, sa->logid, rec, len);
+		free(rec);
+	}
+
+	/* fixed-width row: time, then a value per column */
+	len = sizeof u32 + num * sizeof(int64_t);
+	p = row;
+
+	u32 = htole32((unsigned int) now->tv_sec - mg->origin.tv_sec);
+	memcpy(p, &u32, sizeof u32);
+	p += sizeof u32;
+
+	for (i = 0; i < num; i++) {
+		_stats_value(&stats->node[sa->cols[i].id], &sa->cols[i], &val);
+		val = htole64(val);
+		memcpy(p, &val, sizeof val);
+		p += sizeof val;
+	}
+
+	_stats_log_record(mg, MGSL_ROW, sa->logid, row, len);
+}
+
+/** Stats writer thread: write buffers handed over by _stats_handler() to files */
+static void *_stats_thread(void *arg)
+{
+	struct mg *mg = arg;
+	struct mgstats_async *a = &mg->stats_async;
+	struct stats_writer *sa, *last;
+	struct timespec t1, t2;
+	int b;
+
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		while (a->tail == a->head && !a->stop)
+			pthread_cond_wait(&a->cond, &a->lock);
+
+		if (a->tail == a->head)
+			break;
+
+		b = a->tail % STATS_RING;
+		last = a->last[b];
+		pthread_mutex_unlock(&a->lock);
+
+		/* writers added later are not in this snapshot */
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (sa = mg->stats_writers; sa; sa = (sa == last) ? NULL : sa->next) {
+			if (!sa->ok[b])
+				continue;
+
+			if (mg->options.statslog)
+				_stats_log_write(mg, sa, sa->buf[b], &a->time[b]);
+			else
+				_stats_write(mg, sa, sa->buf[b], &a->time[b]);
+		}
+
+		if (a->log && fflush(a->log) != 0)
+			die("writing %s/%s failed\n", mg->stats_dir, MGSL_FILENAME);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		pthread_mutex_lock(&a->lock);
+		a->flush_time = MIN(UINT32_MAX,
+			(t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_nsec - t1.tv_nsec) / 1000);
+		a->flushed = true;
+		a->tail++;
+		pthread_cond_broadcast(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return NULL;
+}
+
+/** Call handlers of mg->stats_writers and hand their results over to _stats_thread() */
 static void _stats_handler(int fd, short evtype, void *mgarg)
 {
 	struct mg *mg = mgarg;
-	mmatic *mmtmp;
-	stats *stats;
+	struct mgstats_async *a = &mg->stats_async;
 	struct stats_writer *sa;
 	struct timeval tv = {0, 0};
+	uint32_t flush_time;
+	bool flushed, overrun;
+	int b;
 
 	/* reschedule us */
 	tv.tv_sec = mg->options.stats;
 	evtimer_add(&mg->statsev, &tv);
 
-	/* aggregate and write */
-	mmtmp = mmatic_create();
-	tlist_iter_loop(mg->stats_writers, sa) {
-		stats = stats_create(mmtmp);
+	/* bring in frames sent by TX worker threads */
+	mgi_txw_collect(mg);
+
+	/* account previous write; if the thread is STATS_RING rows behind, wait for it rather than
+	 * merge rows of different periods */
+	pthread_mutex_lock(&a->lock);
+	overrun = (a->head - a->tail == STATS_RING);
+	while (a->head - a->tail == STATS_RING)
+		pthread_cond_wait(&a->cond, &a->lock);
+
+	flushed = a->flushed;
+	flush_time = a->flush_time;
+	a->flushed = false;
+	b = a->head % STATS_RING;
+	pthread_mutex_unlock(&a->lock);
+
+	if (overrun) {
+		dbg(1, "stats writer thread late, waited for it\n");
+		stats_icount(mg->stats, ST_STATS_OVERRUN);
+	}
 
-		if (sa->handler(mg, stats, sa->arg))
-			_stats_write(mg, sa, stats);
+	if (flushed)
+		stats_ihist(mg->stats, ST_STATS_FLUSH, flush_time);
+
+	/* aggregate into a free row */
+	for (sa = mg->stats_writers; sa; sa = sa->next) {
+		_stats_reset(sa->buf[b]);
+		sa->ok[b] = sa->handler(mg, sa->buf[b], sa->arg);
 	}
-	mmatic_free(mmtmp);
+
+	/* hand over */
+	pthread_mutex_lock(&a->lock);
+	mgt_now_tv(mg, &a->time[b]);
+	a->last[b] = mg->stats_writers_last;
+	a->head++;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
 }
 
 /*****/
 
 void mgstats_init(struct mg *mg)
 {
-	/* writers */
-	mg->stats_writers = tlist_create(_stats_writer_free, mg->mm);
+	struct mgstats_async *a = &mg->stats_async;
+	int rc;
+
+	if (mg->options.stats == 0) /* stats disabled */
+		return;
+
+	/* start writer thread before anything pins this one to a CPU */
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+
+	rc = pthread_create(&a->thread, NULL, _stats_thread, mg);
+	if (rc != 0)
+		die("stats: pthread_create(): %s\n", strerror(rc));
+}
+
+void mgstats_stop(struct mg *mg)
+{
+	struct mgstats_async *a = &mg->stats_async;
+
+	if (mg->options.stats == 0)
+		return;
+
+	pthread_mutex_lock(&a->lock);
+	a->stop = true;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	pthread_join(a->thread, NULL);
 }
 
 void mgstats_start(struct mg *mg)
@@ -139,7 +568,7 @@ void mgstats_start(struct mg *mg)
 	}
 
 	/* schedule first stats write on origin + stats */
-	gettimeofday(&now, NULL);
+	mgt_now_tv(mg, &now);
 	timersub(&mg->origin, &now, &tv);
 	tv.tv_sec += mg->options.stats;
 
@@ -193,6 +622,7 @@ void mgstats_writer_add(struct mg *mg, stats_writer_handler_t handler, void *arg
 	va_list va;
 	const char *key;
 	struct stats_writer *sa;
+	int i;
 
 	sa = mmatic_zalloc(mg->mm, sizeof *sa);
 	sa->handler = handler;
@@ -206,69 +636,156 @@ void mgstats_writer_add(struct mg *mg, stats_writer_handler_t handler, void *arg
 		tlist_push(sa->columns, mmatic_strdup(mg->mm, key));
 	va_end(va);
 
-	tlist_push(mg->stats_writers, sa);
+	/* resolve column names once, so writes do not need to look them up */
+	sa->cols = mmatic_zalloc(mg->mm, (tlist_count(sa->columns) + 1) * sizeof *sa->cols);
+	i = 0;
+	tlist_iter_loop(sa->columns, key)
+		_stats_column(key, &sa->cols[i++]);
+
+	for (i = 0; i < STATS_RING; i++)
+		sa->buf[i] = stats_create(mg->mm);
+
+	/* append; _stats_thread() does not look past its last writer, so no locking needed */
+	if (mg->stats_writers_last)
+		mg->stats_writers_last->next = sa;
+	else
+		mg->stats_writers = sa;
+	mg->stats_writers_last = sa;
 }
 
 /*****/
 
+int stats_id(const char *name)
+{
+	int i;
+
+	i = _stats_lookup(name);
+	if (i >= 0)
+		return i;
+
+	if (stats_num == STATS_MAX)
+		die("too many distinct statistics (max. %d)\n", STATS_MAX);
+
+	i = stats_num++;
+	stats_names[i] = mmatic_strdup(stats_mm, name);
+	thash_set(stats_ids, stats_names[i], (void *) (long) (i + 1));
+
+	return i;
+}
+
 stats *stats_create(mmatic *mm)
 {
 	stats *stats;
 
 	stats = mmatic_zalloc(mm, sizeof *stats);
 	stats->mm = mm;
-	stats->db = thash_create_strkey(mmatic_free, stats->mm);
 
 	return stats;
 }
 
+void stats_init(stats *stats, mmatic *mm)
+{
+	memset(stats, 0, sizeof *stats);
+	stats->mm = mm;
+}
+
+void stats_hist_init(stats *stats, int id)
+{
+	struct stats_node *n = &stats->node[id];
+
+	if (n->type != STATS_NONE)
+		die("stat '%s' is not a histogram\n", stats_names[id]);
+
+	n->type = STATS_HISTOGRAM;
+	n->as.hist = mmatic_zalloc(stats->mm, sizeof *n->as.hist);
+}
+
 void stats_countN(stats *stats, const char *name, uint32_t num)
 {
-	struct stats_node *n;
+	pjf_assert(stats);
+	stats_icountN(stats, stats_id(name), num);
+}
 
+void stats_mean(stats *stats, const char *name, int val)
+{
 	pjf_assert(stats);
+	stats_imean(stats, stats_id(name), val);
+}
 
-	n = thash_get(stats->db, name);
-	if (n) {
-		n->as.counter += num;
-	} else {
-		n = mmatic_zalloc(stats->mm, sizeof *n);
-		n->type = STATS_COUNTER;
-		thash_set(stats->db, name, n);
+void stats_shard_add(stats *parent, stats *live)
+{
+	struct stats_shard *shard;
 
-		n->as.counter = num;
-	}
+	shard = mmatic_zalloc(parent->mm, sizeof *shard);
+	shard->live = live;
+	shard->next = parent->shards;
+	parent->shards = shard;
 }
 
-void stats_mean(stats *stats, const char *name, int val)
+/* Shard counters are read while the owner writes them, without libatomic: they must be
+ * lock-free on every target, including 32-bit MIPS boards, so keep them at most a word long */
+#if __GCC_ATOMIC_INT_LOCK_FREE != 2
+#error "stats shards need lock-free atomic int"
+#endif
+typedef char stats_counter_lockfree[
+	sizeof(((struct stats_node *) 0)->as.counter) <= sizeof(int) &&
+	sizeof(((struct stats_node *) 0)->type) <= sizeof(int) ? 1 : -1];
+
+/** Add counter increments of shard since previous snapshot to dst
+ * Runs concurrently with the shard owner, so counters are only read. */
+static void _stats_shard_merge(stats *dst_stats, struct stats_shard *shard)
 {
-	struct stats_node *n;
+	stats *live = shard->live;
+	struct stats_node *dst;
+	uint32_t cur[STATS_MAX];
+	uint32_t seq;
+	int i, num;
+
+	/* snapshot: retry if owner was in the middle of stats_write_begin() .. stats_write_end() */
+	do {
+		while ((seq = __atomic_load_n(&live->seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+
+		num = stats_num;
+		for (i = 0; i < num; i++) {
+			if (__atomic_load_n(&live->node[i].type, __ATOMIC_RELAXED) == STATS_COUNTER)
+				cur[i] = __atomic_load_n(&live->node[i].as.counter, __ATOMIC_RELAXED);
+			else
+				cur[i] = 0;
+		}
 
-	pjf_assert(stats);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&live->seq, __ATOMIC_RELAXED) != seq);
 
-	n = thash_get(stats->db, name);
-	if (!n) {
-		n = mmatic_zalloc(stats->mm, sizeof *n);
-		n->type = STATS_GAUGE;
-		thash_set(stats->db, name, n);
+	for (i = 0; i < num; i++) {
+		if (cur[i] == shard->seen[i])
+			continue;
 
-		n->as.gauge = val * 100;
-	} else {
-		n->as.gauge = (n->as.gauge + val * 100) / 2;
+		dst = &dst_stats->node[i];
+		dst->type = STATS_COUNTER;
+		dst->as.counter += cur[i] - shard->seen[i];
+		shard->seen[i] = cur[i];
 	}
 }
 
-void stats_aggregate(stats *dst_stats, stats *src_stats)
+/** Add nodes of src_stats to dst_stats
+ * @param consume   zero counters and histograms of src_stats */
+static void _stats_add(stats *dst_stats, stats *src_stats, bool consume)
 {
-	char *key;
+	int i;
 	struct stats_node *src, *dst;
 
-	thash_iter_loop(src_stats->db, key, src) {
-		dst = thash_get(dst_stats->db, key);
-		if (!dst) {
-			dst = mmatic_zalloc(dst_stats->mm, sizeof *dst);
-			dst->type = src->type;
-			thash_set(dst_stats->db, key, dst);
+	for (i = 0; i < stats_num; i++) {
+		src = &src_stats->node[i];
+		if (src->type == STATS_NONE)
+			continue;
+
+		dst = &dst_stats->node[i];
+		if (dst->type == STATS_NONE) {
+			if (src->type == STATS_HISTOGRAM)
+				stats_hist_init(dst_stats, i);
+			else
+				dst->type = src->type;
 
 			/* needed for accurate values @1 */
 			if (src->type == STATS_GAUGE)
@@ -279,15 +796,37 @@ void stats_aggregate(stats *dst_stats, stats *src_stats)
 			case STATS_COUNTER:
 				/* sum */
 				dst->as.counter += src->as.counter;
-				src->as.counter = 0;
+				if (consume)
+					src->as.counter = 0;
 				break;
 			case STATS_GAUGE:
 				/* @1: mean value */
 				dst->as.gauge = (dst->as.gauge + src->as.gauge) / 2;
 				break;
+			case STATS_HISTOGRAM:
+				/* merge */
+				_stats_hist_merge(dst->as.hist, src->as.hist);
+				if (consume)
+					memset(src->as.hist, 0, sizeof *src->as.hist);
+				break;
 			default:
-				die("unknown type for stat '%s'\n", key);
+				die("unknown type for stat '%s'\n", stats_names[i]);
 				break;
 		}
 	}
 }
+
+void stats_aggregate(stats *dst_stats, stats *src_stats)
+{
+	struct stats_shard *shard;
+
+	for (shard = src_stats->shards; shard; shard = shard->next)
+		_stats_shard_merge(dst_stats, shard);
+
+	_stats_add(dst_stats, src_stats, true);
+}
+
+void stats_merge(stats *dst_stats, stats *src_stats)
+{
+	_stats_add(dst_stats, src_stats, false);
+}
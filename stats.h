@@ -8,9 +8,12 @@
 
 #include "generator.h"
 
-/** Inititalize mgstats data structures, etc. */
+/** Inititalize mgstats data structures, start stats writer thread, etc. */
 void mgstats_init(struct mg *mg);
 
+/** Wait for stats writer thread to write pending stats, and stop it */
+void mgstats_stop(struct mg *mg);
+
 /** Starts statistics system, periodic writes, etc.
  * @note requires mg->origin */
 void mgstats_start(struct mg *mg);
@@ -21,7 +24,8 @@ void mgstats_start(struct mg *mg);
  * @param dir       optional directory under main stats dir
  * @param file      file name for statistics (eg. stats.txt)
  * @param ...       names and order of columns (ie. keys in stats database to export),
- *                  last name must be NULL
+ *                  last name must be NULL; for histograms, names may have a suffix of "_pNN"
+ *                  (percentile, eg. "_p99" or "_p99.9"), "_min", "_max", "_avg" or "_count"
  */
 void mgstats_writer_add(struct mg *mg,
 	stats_writer_handler_t handler, void *arg,
@@ -34,7 +38,89 @@ void mgstats_writer_add(struct mg *mg,
  */
 stats *stats_create(mmatic *mm);
 
+/** Initialize a stats database embedded in another structure
+ * @param mm     memory for histograms
+ */
+void stats_init(stats *stats, mmatic *mm);
+
+/** Get id of statistics name, registering it if needed
+ * @note ids of names listed in enum stats_id are known at compile time */
+int stats_id(const char *name);
+
+/** Increase counter by id
+ * @param id     stat id, see stats_id()
+ * @param num    increase amount
+ */
+static inline void stats_icountN(stats *stats, int id, uint32_t num)
+{
+	struct stats_node *n = &stats->node[id];
+
+	/* only the owner thread writes; atomic stores let readers of shards see whole values,
+	 * without libatomic as long as counters are a word long, see stats.c */
+	__atomic_store_n(&n->type, STATS_COUNTER, __ATOMIC_RELAXED);
+	__atomic_store_n(&n->as.counter, n->as.counter + num, __ATOMIC_RELAXED);
+}
+
+/** Increase counter by id by 1 */
+#define stats_icount(ut, id) stats_icountN(ut, id, 1)
+
+/** Set gauge level by id
+ * @param id     stat id, see stats_id()
+ * @param val    new value for mean
+ */
+static inline void stats_imean(stats *stats, int id, int val)
+{
+	struct stats_node *n = &stats->node[id];
+
+	if (n->type == STATS_NONE) {
+		n->type = STATS_GAUGE;
+		n->as.gauge = val * 100;
+	} else {
+		n->as.gauge = (n->as.gauge + val * 100) / 2;
+	}
+}
+
+/** Get histogram bucket of value */
+static inline int stats_hist_bucket(uint32_t val)
+{
+	int e;
+
+	if (val < (1 << STATS_HIST_SUB_BITS))
+		return val;
+
+	/* e: position of highest bit set; keep next STATS_HIST_SUB_BITS bits as linear sub-bucket */
+	e = 31 - __builtin_clz(val);
+	return ((e - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS)
+		+ ((val >> (e - STATS_HIST_SUB_BITS)) - (1 << STATS_HIST_SUB_BITS));
+}
+
+/** Allocate histogram of stats node */
+void stats_hist_init(stats *stats, int id);
+
+/** Record value in histogram
+ * @param id     stat id, see stats_id()
+ * @param val    value to record, eg. time in [us]
+ */
+static inline void stats_ihist(stats *stats, int id, uint32_t val)
+{
+	struct stats_hist *h;
+
+	if (stats->node[id].type != STATS_HISTOGRAM)
+		stats_hist_init(stats, id);
+
+	h = stats->node[id].as.hist;
+	if (h->count == 0 || val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+
+	h->count++;
+	h->sum += val;
+	h->bucket[stats_hist_bucket(val)]++;
+}
+
 /** Increase counter
+ * @note slower than stats_icountN(), looks name up on every call
  * @param name   stat name
  * @param num    increase amount
  */
@@ -50,9 +136,40 @@ void stats_countN(stats *stats, const char *name, uint32_t num);
 void stats_mean(stats *stats, const char *name, int val);
 
 /** Aggregate statistics
- * @param src    source stats db, after call counters will be zeroed
+ * @param src    source stats db, after call counters and histograms will be zeroed;
+ *               counters of its shards are added too, see stats_shard_add()
  * @param dst    already existing, destination stats db
  */
 void stats_aggregate(stats *dst, stats *src);
 
+/** Aggregate statistics, leaving source untouched
+ * Lets two writers read the same stats db: all but the last one registered should use this.
+ * @param src    source stats db; its shards are not included
+ * @param dst    already existing, destination stats db
+ */
+void stats_merge(stats *dst, stats *src);
+
+/** Start a group of updates of stats db shared as a shard
+ * Readers see either none or all updates made until stats_write_end(). Call from the owner thread. */
+static inline void stats_write_begin(stats *stats)
+{
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/** Finish a group of updates started by stats_write_begin() */
+static inline void stats_write_end(stats *stats)
+{
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+/** Attach stats db updated by another thread to stats
+ * Only counters of live are used, and they are never zeroed: stats_aggregate() takes a snapshot
+ * and adds increments since the previous one. The owner should group updates in
+ * stats_write_begin() and stats_write_end(), so that snapshots are consistent.
+ * @param parent stats db to attach to
+ * @param live   stats db owned by another thread
+ */
+void stats_shard_add(stats *parent, stats *live);
+
 #endif
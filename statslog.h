@@ -0,0 +1,45 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ */
+
+#ifndef _STATSLOG_H_
+#define _STATSLOG_H_
+
+/*
+ * Binary statistics log: single file replacing all statistics files of a node, see options.statslog
+ * and tools/mgstats-convert.c
+ *
+ * File starts with MGSL_MAGIC and uint32_t MGSL_VERSION, followed by records. Each record is
+ * a struct mgsl_hdr and len bytes of data. All integers are little-endian.
+ */
+
+#include <stdint.h>
+
+/** File magic */
+#define MGSL_MAGIC "MGSL"
+
+/** File format version */
+#define MGSL_VERSION 1
+
+/** Name of the log file in the stats dir of node */
+#define MGSL_FILENAME "stats.log"
+
+/** Record types */
+enum mgsl_type {
+	/** new writer: uint32_t number of columns, then NUL-terminated directory name, file name
+	 * and column names; writers are numbered from 0 in order of their schema records */
+	MGSL_SCHEMA = 1,
+
+	/** row of writer: uint32_t time since origin [s], then int64_t value of each column */
+	MGSL_ROW = 2,
+};
+
+/** Record header */
+struct mgsl_hdr {
+	uint32_t type;             /**< enum mgsl_type */
+	uint32_t writer;           /**< writer number */
+	uint32_t len;              /**< length of data that follows */
+};
+
+#endif
@@ -18,6 +18,18 @@
 #define MASTER_TIMEOUT 1
 #define SLAVE_MARGIN (MASTER_OFFER + SLAVE_TIMEOUT)
 
+/** Check if received message comes from a compatible build */
+static bool _check_hdr(struct mg_sync_hdr *hdr, ssize_t len)
+{
+	if (len != sizeof *hdr || hdr->version != MG_SYNC_VERSION) {
+		dbg(0, "ignoring time sync message of other version (size %d, version %u)\n",
+			(int) len, len >= 6 ? hdr->version : 0);
+		return false;
+	}
+
+	return true;
+}
+
 static void _make_offer(struct mg_sync *mgs)
 {
 	struct timeval now;
@@ -25,9 +37,12 @@ static void _make_offer(struct mg_sync *mgs)
 
 	mgs->hdr.code    = htonl(MG_SYNC_OFFER);
 	mgs->hdr.node    = mgs->mg->options.myid;
+	mgs->hdr.version = MG_SYNC_VERSION;
 	mgs->hdr.try     = htonl(ntohl(mgs->hdr.try) + 1);
 	mgs->hdr.time_s  = htonl(now.tv_sec + MASTER_OFFER);
 	mgs->hdr.time_us = htonl(0);
+	mgs->hdr.sent_s  = htonl(now.tv_sec);
+	mgs->hdr.sent_us = htonl(now.tv_usec);
 
 	mgs->mg->origin.tv_sec  = ntohl(mgs->hdr.time_s);
 	mgs->mg->origin.tv_usec = ntohl(mgs->hdr.time_us);
@@ -39,11 +54,13 @@ void _master_read(int s, short evtype, void *arg)
 	struct sockaddr_in src;
 	socklen_t slen = sizeof src;
 	struct mg_sync_hdr hdr;
+	ssize_t len;
 
-	if (recvfrom(s, &hdr, sizeof hdr, 0, (struct sockaddr *) &src, &slen) < 0)
+	len = recvfrom(s, &hdr, sizeof hdr, MSG_TRUNC, (struct sockaddr *) &src, &slen);
+	if (len < 0)
 		die_errno("recvfrom");
 
-	if (ntohl(hdr.code) != MG_SYNC_ACK)
+	if (!_check_hdr(&hdr, len) || ntohl(hdr.code) != MG_SYNC_ACK)
 		return;
 
 	/* ignore bogus ACK */
@@ -141,22 +158,38 @@ static void _slave_read_offer(int s, short evtype, void *arg)
 	struct mg_sync *mgs = arg;
 	struct timeval tv = { SLAVE_TIMEOUT, 0 };
 	struct timeval now;
+	int64_t offset;
+	ssize_t len;
+	int i;
 
-	if (recvfrom(s, &mgs->hdr, sizeof mgs->hdr, 0, (struct sockaddr *) &src, &slen) < 0)
+	len = recvfrom(s, &mgs->hdr, sizeof mgs->hdr, MSG_TRUNC, (struct sockaddr *) &src, &slen);
+	if (len < 0)
 		die_errno("recvfrom");
 
-	if (ntohl(mgs->hdr.code) != MG_SYNC_OFFER)
+	gettimeofday(&now, NULL);
+
+	if (!_check_hdr(&mgs->hdr, len) || ntohl(mgs->hdr.code) != MG_SYNC_OFFER)
 		return;
 
 	dbg(1, "received time sync offer from node %u: %lu\n",
 		mgs->hdr.node, ntohl(mgs->hdr.time_s));
 
+	/* estimate clock offset: the offer was sent no later than we received it, so the master
+	 * clock is at least sent - now ahead of ours; take the tightest bound of latest offers, so
+	 * that a bad one (eg. master clock stepped back) does not stay forever */
+	offset  = ((int64_t) ntohl(mgs->hdr.sent_s) - now.tv_sec) * 1000000;
+	offset += (int64_t) ntohl(mgs->hdr.sent_us) - now.tv_usec;
+	mgs->offsets[mgs->offset_num++ % MG_SYNC_OFFSETS] = offset;
+
+	mgs->mg->clock_offset = offset;
+	for (i = 0; i < MIN(mgs->offset_num, MG_SYNC_OFFSETS); i++)
+		mgs->mg->clock_offset = MAX(mgs->mg->clock_offset, mgs->offsets[i]);
+
 	/* store origin offer */
 	mgs->mg->origin.tv_sec  = ntohl(mgs->hdr.time_s);
 	mgs->mg->origin.tv_usec = ntohl(mgs->hdr.time_us);
 
 	/* check the offer - work around unsychronized system clocks on whole system startup */
-	gettimeofday(&now, NULL);
 	if (mgs->mg->origin.tv_sec <= now.tv_sec) {
 		dbg(1, "offer in the past - ignoring\n");
 		return;
@@ -222,6 +255,7 @@ void mgc_sync(struct mg *mg)
 	mgs.node_min = UINT8_MAX;
 	mgs.node_max = 0;
 	mgs.node_count = 0;
+	mgs.offset_num = 0;
 
 	/* find first and last node taking part in this experiment */
 	for (i = 1; i < TRAFFIC_LINE_MAX; i++) {
@@ -271,9 +305,19 @@ void mgc_sync(struct mg *mg)
 		_master(&mgs);
 	} else if (mgs.exist[mg->options.myid]) { /* slave */
 		_slave(&mgs);
+		dbg(1, "clock offset to master: %lld us\n", (long long) mg->clock_offset);
 	} else {
 		dbg(0, "Not in traffic file - not syncing\n");
 	}
 
 	event_base_free(mgs.evb);
 }
+
+void mgc_to_master(struct mg *mg, const struct timeval *local, struct timeval *master)
+{
+	int64_t us;
+
+	us = (int64_t) local->tv_sec * 1000000 + local->tv_usec + mg->clock_offset;
+	master->tv_sec  = us / 1000000;
+	master->tv_usec = us % 1000000;
+}
@@ -12,4 +12,9 @@
  * Source of first traffic line sends broadcast UDP to 255.255.255.255 */
 void mgc_sync(struct mg *mg);
 
+/** Convert local time to master timebase using clock offset estimated in mgc_sync()
+ * @param local    local time, eg. from gettimeofday()
+ * @param master   [out] corresponding master time */
+void mgc_to_master(struct mg *mg, const struct timeval *local, struct timeval *master);
+
 #endif
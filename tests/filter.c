@@ -0,0 +1,142 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ *
+ * Unit test of the in-kernel frame filter in interface.c: the programs built by _mgi_filter_build()
+ * are attached to one end of a unix socket pair, and frames sent from the other end must pass the
+ * main program iff they are 802.11 data frames in our BSSID destined to this node, and the
+ * inverse program otherwise
+ */
+
+#include "../interface.c"
+
+/* not used by the filter, but referenced by interface.c */
+void mgc_to_master(struct mg *mg, const struct timeval *local, struct timeval *master) { abort(); }
+void mgd_dump(struct sniff_pkt *pkt) { abort(); }
+int mgr_len(struct sniff_pkt *pkt) { abort(); }
+int mgr_decode(struct mgr_cache *cache, struct sniff_pkt *pkt, struct mgr_layout **layout) { abort(); }
+void mgr_decode_rest(struct mgr_layout *layout, struct sniff_pkt *pkt) { abort(); }
+void mgstats_writer_add(struct mg *mg, stats_writer_handler_t handler, void *arg,
+	const char *dir, const char *file, ...) { abort(); }
+stats *stats_create(mmatic *mm) { abort(); }
+void stats_init(stats *stats, mmatic *mm) { abort(); }
+void stats_hist_init(stats *stats, int id) { abort(); }
+void stats_aggregate(stats *dst, stats *src) { abort(); }
+void stats_shard_add(stats *parent, stats *live) { abort(); }
+
+/** Node id of this node */
+#define MYID 5
+
+/** Interface number */
+#define IFNUM 2
+
+static struct mg mg;
+static struct interface interface;
+
+/** Send frame through a filter
+ * @param sample   see _mgi_filter_build()
+ * @retval 1       frame passed
+ * @retval 0       frame dropped
+ * @retval -1      error */
+static int _filter_try(int sample, uint8_t *frame, int len)
+{
+	int sv[2], n = 0;
+	uint8_t buf[PKT_BUFSIZE];
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+
+	if (!_mgi_filter_attach(&interface, sv[1], sample) || send(sv[0], frame, len, 0) != len) {
+		n = -1;
+	} else {
+		while (recv(sv[1], buf, sizeof buf, MSG_DONTWAIT) >= 0)
+			n++;
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	return n;
+}
+
+/** Check both programs on given frame
+ * @param mine     frame should pass the main program
+ * @return         number of errors */
+static int _filter_check(const char *name, uint8_t *frame, int len, bool mine)
+{
+	int main_ok, sample_ok;
+
+	/* 1-in-1 sampling is deterministic */
+	main_ok   = _filter_try(0, frame, len);
+	sample_ok = _filter_try(1, frame, len);
+
+	if (main_ok != mine || sample_ok != !mine) {
+		fprintf(stderr, "filter: %s: main %d, inverse %d, want %d and %d\n",
+			name, main_ok, sample_ok, mine, !mine);
+		return 1;
+	}
+
+	return 0;
+}
+
+/** Build frame with radiotap header of given length, sent by node 7 to node dstid */
+static void _frame_build(uint8_t *frame, int rtlen, uint8_t fc, uint8_t dstid, uint8_t ifnum)
+{
+	uint8_t *h = frame + rtlen;
+
+	memset(frame, 0, PKT_BUFSIZE);
+	frame[2] = rtlen & 0xff;
+	frame[3] = rtlen >> 8;
+
+	h[0]  = fc;
+	h[4]  = 0x06; h[5]  = 0xFE; h[6]  = 0xEE; h[7]  = 0xED; h[8]  = ifnum; h[9]  = dstid;
+	h[10] = 0x06; h[11] = 0xFE; h[12] = 0xEE; h[13] = 0xED; h[14] = ifnum; h[15] = 7;
+	h[16] = 0x06; h[17] = 0xFE; h[18] = 0xEE; h[19] = 0xED; h[20] = 0xFF; h[21] = ifnum;
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t frame[PKT_BUFSIZE];
+	int errors = 0;
+
+	mg.options.myid = MYID;
+	interface.mg = &mg;
+	interface.name = "test";
+	interface.num = IFNUM;
+
+	_frame_build(frame, 18, 0x08, MYID, IFNUM);
+	errors += _filter_check("data to us", frame, 18 + 100, true);
+	errors += _filter_check("data to us, header only", frame, 18 + PKT_IEEE80211_HDRSIZE, true);
+
+	_frame_build(frame, 26, 0x08, MYID, IFNUM);
+	errors += _filter_check("data to us, longer radiotap", frame, 26 + 100, true);
+
+	_frame_build(frame, 18, 0x08, MYID + 1, IFNUM);
+	errors += _filter_check("data to other node", frame, 18 + 100, false);
+
+	_frame_build(frame, 18, 0x08, MYID, IFNUM + 1);
+	errors += _filter_check("data in other BSSID", frame, 18 + 100, false);
+
+	_frame_build(frame, 18, 0x08, MYID, IFNUM);
+	frame[18 + 16] = 0x02;
+	errors += _filter_check("data in foreign BSSID", frame, 18 + 100, false);
+
+	_frame_build(frame, 18, 0x80, MYID, IFNUM);
+	errors += _filter_check("beacon", frame, 18 + 100, false);
+
+	_frame_build(frame, 18, 0x08, MYID, IFNUM);
+	errors += _filter_check("too short for 802.11 header", frame, 18 + PKT_IEEE80211_HDRSIZE - 1, false);
+	errors += _filter_check("ACK-sized", frame, 18 + 14, false);
+
+	_frame_build(frame, 256, 0x08, MYID, IFNUM);
+	errors += _filter_check("radiotap longer than frame", frame, 200, false);
+
+	if (errors) {
+		fprintf(stderr, "filter: %d errors\n", errors);
+		return 1;
+	}
+
+	printf("filter: ok\n");
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ *
+ * Unit test of the timer wheel in schedule.c: timers on all levels and at level boundaries, put
+ * while wheel time is stale, and past MGS_WHEEL_MAX, must fire no earlier than their expiry and
+ * no later than one wheel tick (1 us) after it
+ */
+
+#include "../schedule.c"
+
+/** Number of timers per test */
+#define TIMERS 4096
+
+/* not used by the wheel, but referenced by schedule.c */
+void stats_hist_init(stats *stats, int id) { abort(); }
+
+static struct mgs_wheel wheel;
+static struct schedule timers[TIMERS];
+static int timers_num;
+
+/** Reset wheel to given time */
+static void _wheel_reset(uint64_t now)
+{
+	int i, j;
+
+	memset(&wheel, 0, sizeof wheel);
+	wheel.now = now;
+
+	for (i = 0; i < MGS_WHEEL_NUM; i++) {
+		for (j = 0; j < MGS_WHEEL_LEN; j++)
+			TAILQ_INIT(&wheel.slot[i][j]);
+	}
+	TAILQ_INIT(&wheel.expired);
+
+	memset(timers, 0, sizeof timers);
+	timers_num = 0;
+}
+
+/** Put a timer expiring at given time */
+static void _timer_add(uint64_t expire)
+{
+	struct schedule *sch;
+
+	if (timers_num == TIMERS) {
+		fprintf(stderr, "wheel: too many timers\n");
+		exit(1);
+	}
+
+	sch = &timers[timers_num++];
+	sch->expire = expire;
+	_mgs_wheel_put(&wheel, sch);
+}
+
+/** Put timers expiring around all level boundaries, and randomly within all levels
+ * @param base      time to count from */
+static void _timers_levels(uint64_t base)
+{
+	uint64_t span;
+	int level, i;
+
+	for (level = 0; level <= MGS_WHEEL_NUM; level++) {
+		span = UINT64_C(1) << (level * MGS_WHEEL_BITS);
+
+		_timer_add(base + span - 1);
+		_timer_add(base + span);
+		_timer_add(base + span + 1);
+
+		for (i = 0; i < 16; i++)
+			_timer_add(base + span + ((uint64_t) random() * random()) % (span * (MGS_WHEEL_LEN - 1)));
+	}
+
+	/* past the range handled directly, so re-inserted on the way */
+	_timer_add(base + MGS_WHEEL_MAX - 1);
+	_timer_add(base + MGS_WHEEL_MAX);
+	_timer_add(base + MGS_WHEEL_MAX + 1);
+	_timer_add(base + 3 * MGS_WHEEL_MAX + 7);
+}
+
+/** Run the wheel like _mgs_wheel_run() does, waking up exactly when _mgs_wheel_next() says
+ * @return number of errors */
+static int _wheel_run(const char *name)
+{
+	struct schedule *sch;
+	uint64_t next;
+	int fired = 0, errors = 0;
+
+	while (fired < timers_num) {
+		next = _mgs_wheel_next(&wheel);
+		if (next == UINT64_MAX) {
+			fprintf(stderr, "wheel: %s: wheel empty after %d of %d timers\n",
+				name, fired, timers_num);
+			return errors + 1;
+		}
+
+		_mgs_wheel_update(&wheel, wheel.now + next);
+
+		while ((sch = TAILQ_FIRST(&wheel.expired))) {
+			TAILQ_REMOVE(&wheel.expired, sch, wentry);
+			sch->wlist = NULL;
+			fired++;
+
+			if (wheel.now < sch->expire || wheel.now > sch->expire + 1) {
+				fprintf(stderr, "wheel: %s: timer %d due at %llu fired at %llu\n",
+					name, (int) (sch - timers),
+					(unsigned long long) sch->expire, (unsigned long long) wheel.now);
+				errors++;
+			}
+		}
+	}
+
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t bases[] = {
+		0,
+		UINT64_C(123456789),
+		MGS_WHEEL_MAX,                              /* top level about to wrap */
+		MGS_WHEEL_MAX + 1,                          /* all levels at slot 0 */
+		(UINT64_C(1) << 52) - MGS_WHEEL_LEN / 2,    /* level 0 about to wrap */
+	};
+	uint64_t stale[] = { 1, MGS_WHEEL_LEN, 5000, UINT64_C(1) << 20, MGS_WHEEL_MAX / 2 };
+	char name[64];
+	int i, j, errors = 0;
+
+	srandom(1);
+
+	for (i = 0; i < N(bases); i++) {
+		snprintf(name, sizeof name, "levels at %llu", (unsigned long long) bases[i]);
+		_wheel_reset(bases[i]);
+		_timers_levels(bases[i]);
+		errors += _wheel_run(name);
+
+		/* mgs_schedule() counts from current time, while the wheel may be behind it */
+		for (j = 0; j < N(stale); j++) {
+			snprintf(name, sizeof name, "levels at %llu, wheel %llu us behind",
+				(unsigned long long) bases[i], (unsigned long long) stale[j]);
+			_wheel_reset(bases[i]);
+			_timers_levels(bases[i] + stale[j]);
+			errors += _wheel_run(name);
+		}
+	}
+
+	if (errors) {
+		fprintf(stderr, "wheel: %d errors\n", errors);
+		return 1;
+	}
+
+	printf("wheel: ok\n");
+	return 0;
+}
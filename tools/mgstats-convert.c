@@ -0,0 +1,233 @@
+/*
+ * Paweł Foremski <pjf@iitis.pl> 2011
+ * IITiS PAN Gliwice
+ *
+ * mgstats-convert: regenerate text statistics files from binary stats log, see statslog.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "../statslog.h"
+
+/** Text file of writer */
+struct writer {
+	FILE *fh;                  /**< output file */
+	uint32_t cols;             /**< number of columns */
+};
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "Usage: %s stats.log [output dir]\n", me);
+	fprintf(stderr, "Writes text statistics files into output dir, by default the dir of stats.log\n");
+}
+
+/** Create directory with parents, like mkdir -p */
+static int mkdirs(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+/** Open text file of new writer and write its header line
+ * @param data   MGSL_SCHEMA record data */
+static int schema(struct writer *w, const char *outdir, uint8_t *data, uint32_t len)
+{
+	char path[PATH_MAX];
+	const char *dir, *file, *col;
+	uint8_t *end = data + len;
+	uint32_t i;
+
+	if (len < sizeof(uint32_t) + 2 || end[-1] != '\0')
+		return -1;
+
+	memcpy(&w->cols, data, sizeof w->cols);
+	w->cols = le32toh(w->cols);
+
+	dir  = (char *) data + sizeof(uint32_t);
+	file = dir + strlen(dir) + 1;
+	if ((uint8_t *) file >= end)
+		return -1;
+
+	snprintf(path, sizeof path, "%s/%s", outdir, dir);
+	if (mkdirs(path) < 0) {
+		fprintf(stderr, "mkdir(%s): %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	snprintf(path, sizeof path, "%s/%s/%s", outdir, dir, file);
+	w->fh = fopen(path, "w");
+	if (!w->fh) {
+		fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fputs("#time", w->fh);
+	col = file + strlen(file) + 1;
+	for (i = 0; i < w->cols; i++) {
+		if ((uint8_t *) col >= end)
+			return -1;
+
+		fputc(' ', w->fh);
+		fputs(col, w->fh);
+		col += strlen(col) + 1;
+	}
+	fputs("\n", w->fh);
+
+	return 0;
+}
+
+/** Write row of writer
+ * @param data   MGSL_ROW record data */
+static int row(struct writer *w, uint8_t *data, uint32_t len)
+{
+	uint32_t time, i;
+	int64_t val;
+
+	if (len != sizeof time + w->cols * sizeof val)
+		return -1;
+
+	memcpy(&time, data, sizeof time);
+	fprintf(w->fh, "%u", le32toh(time));
+	data += sizeof time;
+
+	for (i = 0; i < w->cols; i++) {
+		memcpy(&val, data, sizeof val);
+		fprintf(w->fh, " %lld", (long long) (int64_t) le64toh(val));
+		data += sizeof val;
+	}
+	fputs("\n", w->fh);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *in;
+	char magic[4], dir[PATH_MAX];
+	const char *outdir;
+	struct mgsl_hdr hdr;
+	struct writer *w = NULL;
+	uint32_t num = 0, type, id, len, ver;
+	uint8_t *data = NULL;
+	size_t size = 0;
+	int rc = 0;
+
+	if (argc < 2 || argc > 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	in = fopen(argv[1], "r");
+	if (!in) {
+		fprintf(stderr, "fopen(%s): %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (argc == 3) {
+		outdir = argv[2];
+	} else {
+		snprintf(dir, sizeof dir, "%s", argv[1]);
+		outdir = dirname(dir);
+	}
+
+	if (fread(magic, sizeof magic, 1, in) != 1 || memcmp(magic, MGSL_MAGIC, sizeof magic) != 0 ||
+	    fread(&ver, sizeof ver, 1, in) != 1) {
+		fprintf(stderr, "%s: not a stats log\n", argv[1]);
+		return 1;
+	}
+
+	if (le32toh(ver) != MGSL_VERSION) {
+		fprintf(stderr, "%s: unsupported version %u\n", argv[1], le32toh(ver));
+		return 1;
+	}
+
+	while (fread(&hdr, sizeof hdr, 1, in) == 1) {
+		type = le32toh(hdr.type);
+		id   = le32toh(hdr.writer);
+		len  = le32toh(hdr.len);
+
+		if (len > size) {
+			size = len;
+			data = realloc(data, size);
+			if (!data) {
+				fprintf(stderr, "realloc(): %s\n", strerror(errno));
+				return 1;
+			}
+		}
+
+		/* last record may be cut short if node went down while writing */
+		if (len && fread(data, len, 1, in) != 1) {
+			fprintf(stderr, "%s: truncated record, stopping\n", argv[1]);
+			break;
+		}
+
+		switch (type) {
+			case MGSL_SCHEMA:
+				if (id != num) {
+					fprintf(stderr, "%s: unexpected writer %u\n", argv[1], id);
+					rc = 1;
+					continue;
+				}
+
+				w = realloc(w, (num + 1) * sizeof *w);
+				if (!w) {
+					fprintf(stderr, "realloc(): %s\n", strerror(errno));
+					return 1;
+				}
+
+				memset(&w[num], 0, sizeof *w);
+				if (schema(&w[num], outdir, data, len) < 0) {
+					fprintf(stderr, "%s: invalid schema of writer %u\n", argv[1], id);
+					rc = 1;
+				}
+				num++;
+				break;
+
+			case MGSL_ROW:
+				if (id >= num || !w[id].fh || row(&w[id], data, len) < 0) {
+					fprintf(stderr, "%s: invalid row of writer %u\n", argv[1], id);
+					rc = 1;
+				}
+				break;
+
+			default:
+				fprintf(stderr, "%s: skipping record of unknown type %u\n", argv[1], type);
+				break;
+		}
+	}
+
+	for (id = 0; id < num; id++) {
+		if (w[id].fh)
+			fclose(w[id].fh);
+	}
+
+	fclose(in);
+	free(data);
+	free(w);
+
+	return rc;
+}